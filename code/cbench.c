@@ -0,0 +1,337 @@
+/*
+  Benchmark C simulator without process startup or file parsing.
+  Each graph/rat combination is loaded once and then simulated repeatedly,
+  reporting statistics of the nanoseconds per move (NPM) overall and for each phase.
+*/
+
+#include <getopt.h>
+
+#include "crun.h"
+
+/* Graph/rat combinations, as in benchmark.py */
+typedef struct {
+    char name;
+    char gtype;
+    char rtype;
+} benchmark_t;
+
+static benchmark_t benchmark_list[] = {
+    {'A', 't', 'u'},
+    {'B', 'h', 'u'},
+    {'C', 'v', 'u'},
+    {'D', 'p', 'u'},
+    {'E', 'v', 'r'},
+    {'F', 'p', 'd'},
+    {'I', 'i', 'u'},
+};
+
+#define NBENCH (sizeof(benchmark_list)/sizeof(benchmark_t))
+
+/* k/load factor combinations */
+static int load_factor(int k) {
+    switch (k) {
+    case 12:
+	return 4;
+    case 36:
+	return 10;
+    case 60:
+	return 25;
+    case 180:
+	return 32;
+    default:
+	return 0;
+    }
+}
+
+/* Statistics reported for each phase and for overall time.  Load times are in seconds, not NPM */
+#define NSTAT (NPHASE+1)
+static char *stat_name(int p) {
+    switch (p) {
+    case PHASE_GRAPH_LOAD:
+	return "graph_load_seconds";
+    case PHASE_RAT_LOAD:
+	return "rat_load_seconds";
+    case NPHASE:
+	return "total";
+    default:
+	return phase_name[p];
+    }
+}
+
+typedef struct {
+    double median;
+    double p95;
+    double stddev;
+} summary_t;
+
+static void usage(char *name) {
+    char *use_string = "[-k K] [-b BENCHLIST] [-n NSTEP] [-r RUNS] [-w WARMUP] [-u (s|b|r)] [-t THD] [-l] [-c CSVFILE] [-j JSONFILE]";
+    outmsg("Usage: %s %s\n", name, use_string);
+    outmsg("   -h           Print this message\n");
+    outmsg("   -k K         Graph dimension (12, 36, 60, or 180)\n");
+    outmsg("   -b BENCHLIST Benchmarks to perform, as substring of 'ABCDEFI'\n");
+    outmsg("   -n NSTEP     Number of steps in each run\n");
+    outmsg("   -r RUNS      Number of measured runs of each benchmark\n");
+    outmsg("   -w WARMUP    Number of runs before measurement starts\n");
+    outmsg("   -u UPD       Update mode (s, b, or r)\n");
+    outmsg("   -t THD       Number of threads\n");
+    outmsg("   -l           Group rats by node within each batch\n");
+    outmsg("   -c CSVFILE   Write results as CSV\n");
+    outmsg("   -j JSONFILE  Write results as JSON\n");
+    exit(0);
+}
+
+static int comp_double(const void *ap, const void *bp) {
+    double a = *(double *) ap;
+    double b = *(double *) bp;
+    return a < b ? -1 : a > b ? 1 : 0;
+}
+
+/* Compute median, 95th percentile, and standard deviation of n values.  Sorts vals */
+static summary_t summarize(double *vals, int n) {
+    summary_t sum = {0.0, 0.0, 0.0};
+    int i;
+    if (n == 0)
+	return sum;
+    qsort(vals, n, sizeof(double), comp_double);
+    sum.median = n % 2 == 1 ? vals[n/2] : 0.5 * (vals[n/2-1] + vals[n/2]);
+    int p = (int) ceil(0.95 * n) - 1;
+    sum.p95 = vals[p < 0 ? 0 : p];
+    double mean = 0.0;
+    for (i = 0; i < n; i++)
+	mean += vals[i];
+    mean /= n;
+    double var = 0.0;
+    for (i = 0; i < n; i++)
+	var += (vals[i] - mean) * (vals[i] - mean);
+    sum.stddev = n > 1 ? sqrt(var / (n-1)) : 0.0;
+    return sum;
+}
+
+static char *update_name(update_t update_mode) {
+    return update_mode == UPDATE_SYNCHRONOUS ? "s" : update_mode == UPDATE_RAT ? "r" : "b";
+}
+
+/*
+  Run single benchmark.  Stores summary for each statistic in result.
+  Returns false if files could not be loaded
+ */
+static bool run_benchmark(benchmark_t *b, int k, int nstep, int nrun, int nwarmup, update_t update_mode,
+			  bool group, summary_t *result) {
+    char gname[MAXLINE], rname[MAXLINE];
+    int lf = load_factor(k);
+    sprintf(gname, "data/g-%c%.3dx%.3d.gph", b->gtype, k, k);
+    sprintf(rname, "data/r-%.3dx%.3d-%c%d.rats", k, k, b->rtype, lf);
+    FILE *gfile = fopen(gname, "r");
+    if (gfile == NULL) {
+	outmsg("Couldn't open graph file %s.  Skipping benchmark %c\n", gname, b->name);
+	return false;
+    }
+    FILE *rfile = fopen(rname, "r");
+    if (rfile == NULL) {
+	outmsg("Couldn't open rat position file %s.  Skipping benchmark %c\n", rname, b->name);
+	fclose(gfile);
+	return false;
+    }
+    /* Load phases are measured once */
+    double load_secs[2];
+    start_profile();
+    uint64_t start = phase_start();
+    graph_t *g = read_graph(gfile, 1);
+    if (g == NULL || !setup_zone(g, 0))
+	exit(1);
+    phase_end(PHASE_GRAPH_LOAD, start);
+    start = phase_start();
+    state_t *s = read_rats(g, rfile, DEFAULTSEED);
+    if (s == NULL)
+	exit(1);
+    phase_end(PHASE_RAT_LOAD, start);
+    load_secs[0] = phase_ticks[PHASE_GRAPH_LOAD] * secondsPerTick();
+    load_secs[1] = phase_ticks[PHASE_RAT_LOAD] * secondsPerTick();
+    s->group_rats = group;
+
+    /* Save initial state, so that every run performs the same simulation */
+    int nrat = s->nrat;
+    int *init_id = int_alloc(nrat);
+    int *init_position = int_alloc(nrat);
+    random_t *init_seed = rt_alloc(nrat);
+    double *npm = double_alloc((size_t) NSTAT * nrun);
+    if (init_id == NULL || init_position == NULL || init_seed == NULL || npm == NULL) {
+	outmsg("Couldn't allocate space for benchmark\n");
+	exit(1);
+    }
+    memcpy(init_id, s->rat_id, nrat * sizeof(int));
+    memcpy(init_position, s->rat_position, nrat * sizeof(int));
+    memcpy(init_seed, s->rat_seed, nrat * sizeof(random_t));
+
+    double moves = (double) nrat * nstep;
+    int r, p;
+    for (r = -nwarmup; r < nrun; r++) {
+	memcpy(s->rat_id, init_id, nrat * sizeof(int));
+	memcpy(s->rat_position, init_position, nrat * sizeof(int));
+	memcpy(s->rat_seed, init_seed, nrat * sizeof(random_t));
+	start_profile();
+	double secs = simulate(s, nstep, update_mode, 1, false);
+	if (r < 0)
+	    continue;
+	for (p = 0; p < NPHASE; p++)
+	    npm[p * nrun + r] = 1e9 * phase_ticks[p] * secondsPerTick() / moves;
+	npm[NPHASE * nrun + r] = 1e9 * secs / moves;
+    }
+    for (p = 0; p < NSTAT; p++)
+	result[p] = summarize(&npm[p * nrun], nrun);
+    /* Report load times as seconds, rather than per move */
+    result[PHASE_GRAPH_LOAD].median = result[PHASE_GRAPH_LOAD].p95 = load_secs[0];
+    result[PHASE_RAT_LOAD].median = result[PHASE_RAT_LOAD].p95 = load_secs[1];
+    result[PHASE_GRAPH_LOAD].stddev = result[PHASE_RAT_LOAD].stddev = 0.0;
+    free(init_id);
+    free(init_position);
+    free(init_seed);
+    free(npm);
+    free_rats(s);
+    clear_zone(g);
+    free_graph(g);
+    return true;
+}
+
+int main(int argc, char *argv[]) {
+    int k = 180;
+    int nstep = 100;
+    int nrun = 5;
+    int nwarmup = 1;
+    int thread_count = 1;
+    update_t update_mode = UPDATE_BATCH;
+    bool group = false;
+    char *blist = "ABCDEFI";
+    FILE *csvfile = NULL;
+    FILE *jsonfile = NULL;
+    int c;
+    char *optstring = "hk:b:n:r:w:u:t:lc:j:";
+    while ((c = getopt(argc, argv, optstring)) != -1) {
+	switch(c) {
+	case 'h':
+	    usage(argv[0]);
+	    break;
+	case 'k':
+	    k = atoi(optarg);
+	    if (load_factor(k) == 0) {
+		outmsg("Invalid graph dimension %d\n", k);
+		usage(argv[0]);
+	    }
+	    break;
+	case 'b':
+	    blist = optarg;
+	    break;
+	case 'n':
+	    nstep = atoi(optarg);
+	    break;
+	case 'r':
+	    nrun = atoi(optarg);
+	    break;
+	case 'w':
+	    nwarmup = atoi(optarg);
+	    break;
+	case 'u':
+	    if (strcmp(optarg, "s") == 0)
+		update_mode = UPDATE_SYNCHRONOUS;
+	    else if (strcmp(optarg, "b") == 0)
+		update_mode = UPDATE_BATCH;
+	    else if (strcmp(optarg, "r") == 0)
+		update_mode = UPDATE_RAT;
+	    else {
+		outmsg("Unknown update mode '%s'\n", optarg);
+		usage(argv[0]);
+	    }
+	    break;
+	case 't':
+	    thread_count = atoi(optarg);
+	    break;
+	case 'l':
+	    group = true;
+	    break;
+	case 'c':
+	    csvfile = fopen(optarg, "w");
+	    if (csvfile == NULL) {
+		outmsg("Couldn't open CSV file %s\n", optarg);
+		exit(1);
+	    }
+	    break;
+	case 'j':
+	    jsonfile = fopen(optarg, "w");
+	    if (jsonfile == NULL) {
+		outmsg("Couldn't open JSON file %s\n", optarg);
+		exit(1);
+	    }
+	    break;
+	default:
+	    outmsg("Unknown option '%c'\n", c);
+	    usage(argv[0]);
+	}
+    }
+    if (nrun < 1 || nstep < 1 || nwarmup < 0) {
+	outmsg("Need at least one run of at least one step\n");
+	usage(argv[0]);
+    }
+#ifdef _OPENMP
+    if (thread_count > 0)
+	omp_set_num_threads(thread_count);
+#else
+    thread_count = 1;
+#endif
+
+    if (csvfile)
+	fprintf(csvfile, "name,dim,gtype,lf,rtype,steps,update,threads,runs,stat,median_npm,p95_npm,stddev_npm\n");
+    if (jsonfile)
+	fprintf(jsonfile, "[");
+    bool first = true;
+    int lf = load_factor(k);
+    printf("Name\tDim\tgtype\tlf\trtype\tsteps\tupdate\tthreads\tmedian\tp95\tstddev\n");
+    int i, p;
+    for (i = 0; blist[i]; i++) {
+	benchmark_t *b = NULL;
+	size_t j;
+	for (j = 0; j < NBENCH; j++)
+	    if (benchmark_list[j].name == toupper(blist[i]))
+		b = &benchmark_list[j];
+	if (b == NULL) {
+	    outmsg("Unknown benchmark '%c'\n", blist[i]);
+	    continue;
+	}
+	summary_t result[NSTAT];
+	if (!run_benchmark(b, k, nstep, nrun, nwarmup, update_mode, group, result))
+	    continue;
+	summary_t *total = &result[NPHASE];
+	printf("%c\t%5d\t%c\t%4d\t%c\t%d\t%s\t%d\t%.2f\t%.2f\t%.2f\n",
+	       b->name, k, b->gtype, lf, b->rtype, nstep, update_name(update_mode), thread_count,
+	       total->median, total->p95, total->stddev);
+	for (p = PHASE_CENSUS; p < NSTAT; p++)
+	    printf("\t%s\t\t\t\t\t\t\t%.2f\t%.2f\t%.2f\n", stat_name(p),
+		   result[p].median, result[p].p95, result[p].stddev);
+	fflush(stdout);
+	if (csvfile) {
+	    for (p = 0; p < NSTAT; p++)
+		fprintf(csvfile, "%c,%d,%c,%d,%c,%d,%s,%d,%d,%s,%.4f,%.4f,%.4f\n",
+			b->name, k, b->gtype, lf, b->rtype, nstep, update_name(update_mode),
+			thread_count, nrun, stat_name(p),
+			result[p].median, result[p].p95, result[p].stddev);
+	}
+	if (jsonfile) {
+	    fprintf(jsonfile, "%s\n {\"name\": \"%c\", \"dim\": %d, \"gtype\": \"%c\", \"lf\": %d, \"rtype\": \"%c\", "
+		    "\"steps\": %d, \"update\": \"%s\", \"threads\": %d, \"runs\": %d, \"stats\": {",
+		    first ? "" : ",", b->name, k, b->gtype, lf, b->rtype, nstep,
+		    update_name(update_mode), thread_count, nrun);
+	    for (p = 0; p < NSTAT; p++)
+		fprintf(jsonfile, "%s\"%s\": {\"median\": %.4f, \"p95\": %.4f, \"stddev\": %.4f}",
+			p == 0 ? "" : ", ", stat_name(p), result[p].median, result[p].p95, result[p].stddev);
+	    fprintf(jsonfile, "}}");
+	}
+	first = false;
+    }
+    if (csvfile)
+	fclose(csvfile);
+    if (jsonfile) {
+	fprintf(jsonfile, "\n]\n");
+	fclose(jsonfile);
+    }
+    return 0;
+}
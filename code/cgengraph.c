@@ -0,0 +1,533 @@
+/*
+  Generate graph and rat files.  C version of gengraph.py:
+  same graph types, zones, and random number generator, and so gives
+  the same files, but fast enough for graphs far larger than those in data/.
+  Can also write binary graph and rat files directly.
+*/
+
+#include <getopt.h>
+#include <time.h>
+
+#include "crun.h"
+
+static void usage(char *name) {
+    char *use_string = "[-h] [-z] [-b] [-k K] [-t (u|t|v|h|p|i)] [-l L:H] [-s SEED] [-o OUT] [-r RFILE [-m (u|d|l|r)] [-L LOAD] [-S RSEED]]";
+    outmsg("Usage: %s %s\n", name, use_string);
+    outmsg("   -h        Print this message\n");
+    outmsg("   -z        Include zones in graph file\n");
+    outmsg("   -b        Write binary graph and rat files\n");
+    outmsg("   -k K      Base graph as k x k grid\n");
+    outmsg("   -t TYPE   Graph type:\n");
+    outmsg("             u: uniform\n");
+    outmsg("             t: tiled\n");
+    outmsg("             v: vertical slices\n");
+    outmsg("             h: horizontal slices\n");
+    outmsg("             p: parquet\n");
+    outmsg("             i: irregular\n");
+    outmsg("   -l L:H    Range of ideal load factors\n");
+    outmsg("   -s SEED   Seed for ideal load factors\n");
+    outmsg("   -o OUT    Graph file (default stdout)\n");
+    outmsg("   -r RFILE  Also generate rat file\n");
+    outmsg("   -m MODE   Initial rat positions:\n");
+    outmsg("             u: uniform (default)\n");
+    outmsg("             d: diagonal\n");
+    outmsg("             l: upper-left\n");
+    outmsg("             r: lower-right\n");
+    outmsg("   -L LOAD   Rats per node (default 1)\n");
+    outmsg("   -S RSEED  Seed for rat positions\n");
+    exit(0);
+}
+
+/* Graph types, with names as in gengraph.py */
+typedef enum { GRAPH_UNIFORM, GRAPH_TILED, GRAPH_VERTICAL, GRAPH_HORIZONTAL,
+	       GRAPH_PARQUET, GRAPH_IRREGULAR, NGRAPH } gtype_t;
+static char *gtype_tag = "utvhpi";
+static char *gtype_name[NGRAPH] = { "uniform", " tiled", " vertical", " horizontal", " parquet", " irregular" };
+
+/* Rat modes, with names as in gengraph.py */
+typedef enum { RAT_UNIFORM, RAT_DIAGONAL, RAT_UPLEFT, RAT_LOWRIGHT, NRAT } rmode_t;
+static char *rmode_tag = "udlr";
+static char *rmode_name[NRAT] = { "uniform", "diagonal", "upper-left", "lower-right" };
+
+/* Zone given by upper lefthand corner, width, and height */
+typedef struct {
+    int x;
+    int y;
+    int w;
+    int h;
+} zone_t;
+
+/* Graph under construction.  Edges are accumulated in both directions, possibly with duplicates */
+typedef struct {
+    int k;
+    int nnode;
+    bool do_zone;
+    // Edge list
+    int *head;
+    int *tail;
+    size_t nedge;
+    size_t edge_capacity;
+    // Zone list
+    zone_t *zone;
+    int nzone;
+    int zone_capacity;
+} gen_t;
+
+static void *grow(void *data, size_t *capacity, size_t needed, size_t size) {
+    if (needed <= *capacity)
+	return data;
+    size_t ncap = *capacity == 0 ? 1024 : *capacity;
+    while (ncap < needed)
+	ncap *= 2;
+    data = realloc(data, ncap * size);
+    if (data == NULL) {
+	outmsg("Couldn't allocate space for graph\n");
+	exit(1);
+    }
+    *capacity = ncap;
+    return data;
+}
+
+static inline int node_id(gen_t *gen, int r, int c) {
+    if (r < 0 || r >= gen->k || c < 0 || c >= gen->k)
+	return -1;
+    return r * gen->k + c;
+}
+
+static void add_edge(gen_t *gen, int i, int j) {
+    if (i < 0 || j < 0) {
+	outmsg("Error: Invalid node id %d\n", i < 0 ? i : j);
+	return;
+    }
+    if (i == j)
+	return;
+    size_t cap = gen->edge_capacity;
+    gen->head = grow(gen->head, &cap, gen->nedge + 2, sizeof(int));
+    cap = gen->edge_capacity;
+    gen->tail = grow(gen->tail, &cap, gen->nedge + 2, sizeof(int));
+    gen->edge_capacity = cap;
+    gen->head[gen->nedge] = i;
+    gen->tail[gen->nedge++] = j;
+    gen->head[gen->nedge] = j;
+    gen->tail[gen->nedge++] = i;
+}
+
+static void add_zone(gen_t *gen, int x, int y, int w, int h) {
+    if (!gen->do_zone)
+	return;
+    size_t cap = gen->zone_capacity;
+    gen->zone = grow(gen->zone, &cap, gen->nzone + 1, sizeof(zone_t));
+    gen->zone_capacity = cap;
+    zone_t *z = &gen->zone[gen->nzone++];
+    z->x = x; z->y = y; z->w = w; z->h = h;
+}
+
+/* Connect center of rectangle to all of its nodes */
+static void make_hub(gen_t *gen, int x, int y, int w, int h) {
+    int wsep = w <= 2 ? w : w/2;
+    int hsep = h/2;
+    int cx;
+    if (w <= 1)
+	cx = x;
+    else if (w <= 2)
+	cx = 1 + x;
+    else
+	cx = x + wsep;
+    int cy = y + hsep;
+    int cid = node_id(gen, cy, cx);
+    int i, j;
+    for (j = 0; j < w; j++)
+	for (i = 0; i < h; i++)
+	    add_edge(gen, cid, node_id(gen, y+i, x+j));
+}
+
+static void tile(gen_t *gen, int tile_x, int tile_y) {
+    int k = gen->k;
+    int x, y, w, h;
+    for (x = 0; x < k; x += tile_x) {
+	w = tile_x < k - x ? tile_x : k - x;
+	for (y = 0; y < k - tile_y + 1; y += tile_y) {
+	    h = tile_y < k - y ? tile_y : k - y;
+	    make_hub(gen, x, y, w, h);
+	}
+    }
+    if (tile_x == k/6 && tile_y == k/6) {
+	/* Create different rectangular zones */
+	w = k/2;
+	h = k/6;
+    } else {
+	w = tile_x;
+	h = tile_y;
+    }
+    for (x = 0; x < k; x += w)
+	for (y = 0; y < k; y += h)
+	    add_zone(gen, x, y, w, h);
+}
+
+/* Hub in each of regions along one axis */
+static void hub_row(gen_t *gen, int x, int y, int w, int h, int dx, int dy, int count) {
+    int i;
+    for (i = 0; i < count; i++) {
+	make_hub(gen, x + i*dx, y + i*dy, w, h);
+	add_zone(gen, x + i*dx, y + i*dy, w, h);
+    }
+}
+
+static void parquet(gen_t *gen) {
+    int unit = gen->k/6;
+    /* Upper left, upper right, lower left, lower right */
+    hub_row(gen, 0, 0, 3*unit, unit, 0, unit, 3);
+    hub_row(gen, 3*unit, 0, unit, 3*unit, unit, 0, 3);
+    hub_row(gen, 0, 3*unit, unit, 3*unit, unit, 0, 3);
+    hub_row(gen, 3*unit, 3*unit, 3*unit, unit, 0, unit, 3);
+}
+
+static void irregular(gen_t *gen) {
+    int unit = gen->k/12;
+    /* Upper left, upper right, lower left, lower right */
+    hub_row(gen, 0, 0, 4*unit, 6*unit, 0, 0, 1);
+    hub_row(gen, 4*unit, 0, 8*unit, 2*unit, 0, 2*unit, 3);
+    hub_row(gen, 0, 6*unit, 6*unit, 3*unit, 0, 3*unit, 2);
+    hub_row(gen, 6*unit, 6*unit, 3*unit, 6*unit, 3*unit, 0, 2);
+}
+
+static bool feasible(gtype_t gtype, int k) {
+    int cells = 1;
+    if (gtype == GRAPH_VERTICAL || gtype == GRAPH_HORIZONTAL || gtype == GRAPH_IRREGULAR)
+	cells = 12;
+    if (gtype == GRAPH_TILED || gtype == GRAPH_PARQUET)
+	cells = 6;
+    return k > 0 && k % cells == 0;
+}
+
+static void generate(gen_t *gen, gtype_t gtype) {
+    int k = gen->k;
+    int r, c;
+    /* Grid edges */
+    for (r = 0; r < k; r++) {
+	for (c = 0; c < k; c++) {
+	    int own = node_id(gen, r, c);
+	    int nbr[4] = { node_id(gen, r-1, c), node_id(gen, r+1, c),
+			   node_id(gen, r, c-1), node_id(gen, r, c+1) };
+	    int i;
+	    for (i = 0; i < 4; i++)
+		if (nbr[i] >= 0)
+		    add_edge(gen, own, nbr[i]);
+	}
+    }
+    switch (gtype) {
+    case GRAPH_TILED:
+	tile(gen, k/6, k/6);
+	break;
+    case GRAPH_VERTICAL:
+	tile(gen, k/12, k);
+	break;
+    case GRAPH_HORIZONTAL:
+	tile(gen, k, k/12);
+	break;
+    case GRAPH_PARQUET:
+	parquet(gen);
+	break;
+    case GRAPH_IRREGULAR:
+	irregular(gen);
+	break;
+    default:
+	for (r = 0; r < k; r++)
+	    for (c = 0; c < k; c++)
+		add_zone(gen, c, r, 1, 1);
+	break;
+    }
+}
+
+/*
+  Convert edge list into adjacency lists, sorted and without duplicates,
+  with self edge first as in graph.c.
+  Edges in this order are also the sorted edge list of gengraph.py
+ */
+static graph_t *build_graph(gen_t *gen) {
+    int nnode = gen->nnode;
+    size_t i;
+    int nid;
+    int *start = int_alloc(nnode + 1);
+    int *adj = int_alloc(gen->nedge);
+    if (start == NULL || adj == NULL) {
+	outmsg("Couldn't allocate space for graph\n");
+	exit(1);
+    }
+    for (i = 0; i < gen->nedge; i++)
+	start[gen->head[i]+1]++;
+    for (nid = 0; nid < nnode; nid++)
+	start[nid+1] += start[nid];
+    int *next = int_alloc(nnode);
+    memcpy(next, start, nnode * sizeof(int));
+    for (i = 0; i < gen->nedge; i++)
+	adj[next[gen->head[i]]++] = gen->tail[i];
+    free(next);
+    free(gen->head);
+    free(gen->tail);
+    gen->head = gen->tail = NULL;
+
+    /* Sort each list, remove duplicates, and put self edge first */
+    int nedge = 0;
+    for (nid = 0; nid < nnode; nid++) {
+	int len = start[nid+1] - start[nid];
+	int *list = adj + start[nid];
+	qsort(list, len, sizeof(int), comp_int);
+	int j;
+	for (j = 0; j < len; j++)
+	    if (j == 0 || list[j] != list[j-1])
+		nedge++;
+    }
+    graph_t *g = new_graph(nnode, nedge, 0);
+    if (g == NULL)
+	exit(1);
+    int eid = 0;
+    for (nid = 0; nid < nnode; nid++) {
+	int *list = adj + start[nid];
+	int len = start[nid+1] - start[nid];
+	int j;
+	g->neighbor_start[nid] = eid;
+	g->neighbor[eid++] = nid;
+	for (j = 0; j < len; j++)
+	    if (j == 0 || list[j] != list[j-1])
+		g->neighbor[eid++] = list[j];
+    }
+    g->neighbor_start[nnode] = eid;
+    free(start);
+    free(adj);
+
+    /* Binary format always has zones.  Without them, whole graph is one zone */
+    g->nfzone = gen->nzone > 0 ? gen->nzone : 1;
+    g->fzone_id = int_alloc(nnode);
+    if (g->fzone_id == NULL) {
+	outmsg("Couldn't allocate space for graph\n");
+	exit(1);
+    }
+    int z, x, y;
+    for (z = 0; z < gen->nzone; z++) {
+	zone_t *zp = &gen->zone[z];
+	for (y = zp->y; y < zp->y + zp->h && y < gen->k; y++)
+	    for (x = zp->x; x < zp->x + zp->w && x < gen->k; x++)
+		g->fzone_id[node_id(gen, y, x)] = z;
+    }
+    return g;
+}
+
+/* Current time, as given by Python's ctime() */
+static char *now() {
+    static char buf[64];
+    time_t t = time(NULL);
+    strncpy(buf, ctime(&t), sizeof(buf)-1);
+    buf[strcspn(buf, "\n")] = '\0';
+    return buf;
+}
+
+static bool write_graph_text(gen_t *gen, graph_t *g, gtype_t gtype, double ilf_low, double ilf_high,
+			     random_t seed, FILE *outfile) {
+    int nid, eid;
+    random_t rseed;
+    random_t seeds[1] = { seed };
+    reseed(&rseed, seeds, 1);
+    if (gen->do_zone)
+	fprintf(outfile, "%d %d %d\n", g->nnode, g->nedge, gen->nzone);
+    else
+	fprintf(outfile, "%d %d\n", g->nnode, g->nedge);
+    fprintf(outfile, "# Generated %s\n", now());
+    fprintf(outfile, "# Parameters: k = %d, type = %s, ilf = (%.2f,%.2f)\n",
+	    gen->k, gtype_name[gtype], ilf_low, ilf_high);
+    for (nid = 0; nid < g->nnode; nid++)
+	fprintf(outfile, "n %.5f\n", ilf_low + next_random_float(&rseed, ilf_high - ilf_low));
+    for (nid = 0; nid < g->nnode; nid++)
+	/* Skip self edge */
+	for (eid = g->neighbor_start[nid]+1; eid < g->neighbor_start[nid+1]; eid++)
+	    fprintf(outfile, "e %d %d\n", nid, g->neighbor[eid]);
+    int z;
+    for (z = 0; z < gen->nzone; z++)
+	fprintf(outfile, "z %d %d %d %d\n", gen->zone[z].x, gen->zone[z].y, gen->zone[z].w, gen->zone[z].h);
+    if (ferror(outfile)) {
+	outmsg("ERROR.  Couldn't write graph file\n");
+	return false;
+    }
+    return true;
+}
+
+/*
+  Generate rats as in gengraph.py: each listed starting node gets
+  equal share of rats, and then the rats are randomly permuted.
+ */
+static bool write_rats(gen_t *gen, rmode_t mode, int load, random_t seed, bool binary, FILE *outfile) {
+    int nnode = gen->nnode;
+    int k = gen->k;
+    int nstart = mode == RAT_DIAGONAL ? k : mode == RAT_UNIFORM ? nnode : 1;
+    int *start = int_alloc(nstart);
+    int i;
+    for (i = 0; i < nstart; i++) {
+	if (mode == RAT_UNIFORM)
+	    start[i] = i;
+	else if (mode == RAT_DIAGONAL)
+	    start[i] = (k+1) * i;
+	else
+	    start[i] = mode == RAT_UPLEFT ? 0 : nnode-1;
+    }
+    int64_t factor = (int64_t) nnode * load / nstart;
+    if (factor * nstart > INT32_MAX) {
+	outmsg("Too many rats (%" PRId64 ")\n", factor * nstart);
+	return false;
+    }
+    int nrat = factor * nstart;
+    /* Rat i is at start node perm[i] % nstart */
+    int *perm = int_alloc(nrat);
+    if (perm == NULL) {
+	outmsg("Couldn't allocate space for %d rats\n", nrat);
+	return false;
+    }
+    for (i = 0; i < nrat; i++)
+	perm[i] = i;
+    random_t rseed;
+    random_t seeds[1] = { seed };
+    reseed(&rseed, seeds, 1);
+    int n;
+    for (n = nrat; n > 1; n--) {
+	int idx = (int) (next_random_float(&rseed, 1.0) * n);
+	int t = perm[idx];
+	perm[idx] = perm[n-1];
+	perm[n-1] = t;
+    }
+    for (i = 0; i < nrat; i++)
+	perm[i] = start[perm[i] % nstart];
+    bool ok;
+    if (binary) {
+	rat_header_t header;
+	memcpy(header.magic, RAT_MAGIC, sizeof(header.magic));
+	header.nnode = nnode;
+	header.nrat = nrat;
+	header.pad = 0;
+	ok = fwrite(&header, sizeof(header), 1, outfile) == 1;
+	ok = ok && fwrite(perm, sizeof(int), nrat, outfile) == nrat;
+    } else {
+	fprintf(outfile, "%d %d\n", nnode, nrat);
+	fprintf(outfile, "# Generated %s\n", now());
+	fprintf(outfile, "# Parameters: load = %d, mode = %s, seed = %u\n", load, rmode_name[mode], (unsigned) seed);
+	for (i = 0; i < nrat; i++)
+	    fprintf(outfile, "%d\n", perm[i]);
+	ok = !ferror(outfile);
+    }
+    if (!ok)
+	outmsg("ERROR.  Couldn't write rat file\n");
+    free(start);
+    free(perm);
+    return ok;
+}
+
+static FILE *open_file(char *name, char *mode) {
+    FILE *f = fopen(name, mode);
+    if (f == NULL) {
+	outmsg("Couldn't open file %s\n", name);
+	exit(1);
+    }
+    return f;
+}
+
+int main(int argc, char *argv[]) {
+    gen_t gen;
+    memset(&gen, 0, sizeof(gen));
+    int k = 10;
+    gtype_t gtype = GRAPH_UNIFORM;
+    rmode_t rmode = RAT_UNIFORM;
+    double ilf_low = 1.2;
+    double ilf_high = 1.8;
+    random_t gseed = DEFAULTSEED;
+    random_t rseed = DEFAULTSEED;
+    int load = 1;
+    bool binary = false;
+    char *gname = NULL;
+    char *rname = NULL;
+    char *pos;
+    int c;
+    char *optstring = "hzbk:t:l:s:o:r:m:L:S:";
+    while ((c = getopt(argc, argv, optstring)) != -1) {
+	switch(c) {
+	case 'h':
+	    usage(argv[0]);
+	    break;
+	case 'z':
+	    gen.do_zone = true;
+	    break;
+	case 'b':
+	    binary = true;
+	    break;
+	case 'k':
+	    k = atoi(optarg);
+	    break;
+	case 't':
+	    pos = strchr(gtype_tag, optarg[0]);
+	    if (pos == NULL || optarg[0] == '\0' || optarg[1] != '\0') {
+		outmsg("Unknown graph type '%s'\n", optarg);
+		usage(argv[0]);
+	    }
+	    gtype = pos - gtype_tag;
+	    break;
+	case 'l':
+	    if (sscanf(optarg, "%lf:%lf", &ilf_low, &ilf_high) != 2) {
+		outmsg("Ideal load factor requires two numeric parameters\n");
+		usage(argv[0]);
+	    }
+	    break;
+	case 's':
+	    gseed = strtoul(optarg, NULL, 0);
+	    break;
+	case 'o':
+	    gname = optarg;
+	    break;
+	case 'r':
+	    rname = optarg;
+	    break;
+	case 'm':
+	    pos = strchr(rmode_tag, optarg[0]);
+	    if (pos == NULL || optarg[0] == '\0' || optarg[1] != '\0') {
+		outmsg("Unknown rat mode '%s'\n", optarg);
+		usage(argv[0]);
+	    }
+	    rmode = pos - rmode_tag;
+	    break;
+	case 'L':
+	    load = atoi(optarg);
+	    break;
+	case 'S':
+	    rseed = strtoul(optarg, NULL, 0);
+	    break;
+	default:
+	    outmsg("Unknown option '%c'\n", c);
+	    usage(argv[0]);
+	}
+    }
+    if (!feasible(gtype, k)) {
+	outmsg("Cannot generate graph of type %s for k = %d\n", gtype_name[gtype], k);
+	exit(1);
+    }
+    if ((int64_t) k * k > INT32_MAX / 8) {
+	outmsg("Graph with k = %d too large\n", k);
+	exit(1);
+    }
+    if (load < 1) {
+	outmsg("Load must be at least 1\n");
+	exit(1);
+    }
+    gen.k = k;
+    gen.nnode = k * k;
+    generate(&gen, gtype);
+    graph_t *g = build_graph(&gen);
+    FILE *gfile = gname == NULL ? stdout : open_file(gname, "w");
+    bool ok = binary ? write_graph_binary(g, gfile) :
+	write_graph_text(&gen, g, gtype, ilf_low, ilf_high, gseed, gfile);
+    if (gname != NULL)
+	ok = fclose(gfile) == 0 && ok;
+    if (ok && rname != NULL) {
+	FILE *rfile = open_file(rname, "w");
+	ok = write_rats(&gen, rmode, load, rseed, binary, rfile);
+	ok = fclose(rfile) == 0 && ok;
+    }
+    free(gen.zone);
+    free_graph(g);
+    return ok ? 0 : 1;
+}
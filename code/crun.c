@@ -14,7 +14,7 @@ static void full_exit(int code) {
 }
 
 static void usage(char *name) {
-    char *use_string = "-g GFILE -r RFILE [-n STEPS] [-s SEED] [-q] [-i INT]";
+    char *use_string = "-g GFILE -r RFILE [-n STEPS] [-s SEED] [-q] [-i INT] [-t THD] [-u (s|b|r)] [-o (t|b|d)] [-O (r|z)] [-l] [-P] [-c CFILE [-k K]] [-C CFILE] [-S SFILE] [-B K] [-e K [-f OFILE]]";
     outmsg("Usage: %s %s\n", name, use_string);
     outmsg("   -h        Print this message\n");
     outmsg("   -g GFILE  Graph file\n");
@@ -23,9 +23,80 @@ static void usage(char *name) {
     outmsg("   -s SEED   Initial RNG seed\n");
     outmsg("   -q        Operate in quiet mode.  Do not generate simulation results\n");
     outmsg("   -i INT    Display update interval\n");
+    outmsg("   -t THD    Number of threads\n");
+    outmsg("   -u UPD    Update mode:\n");
+    outmsg("             s: Synchronous\n");
+    outmsg("             b: Batch (default)\n");
+    outmsg("             r: Rat-order\n");
+    outmsg("   -o OUT    Output format:\n");
+    outmsg("             t: Text (default)\n");
+    outmsg("             b: Binary counts\n");
+    outmsg("             d: Binary changes in counts\n");
+    outmsg("   -O ORD    Renumber graph nodes for locality:\n");
+    outmsg("             r: Reverse Cuthill-McKee (within each zone)\n");
+    outmsg("             z: Zone-major, following zones in graph file\n");
+    outmsg("   -l        Group rats by node within each batch\n");
+    outmsg("   -P        Profile.  Print time spent in each phase on stderr\n");
+    outmsg("   -c CFILE  Write checkpoint.  With multiple processes, each writes shard CFILE.Z\n");
+    outmsg("   -k K      Write checkpoint every K steps (default: after last step)\n");
+    outmsg("   -C CFILE  Restart from checkpoint rather than rat file.  STEPS is total including those already run\n");
+    outmsg("   -S SFILE  Print load statistics for each step to SFILE ('-' for stderr)\n");
+    outmsg("   -B K      Assign graph file zones to processes by estimated load.  Reassign every K steps (0: only at start)\n");
+    outmsg("   -e K      Ensemble: run K replicas with seeds SEED .. SEED+K-1, sharing the graph (single process)\n");
+    outmsg("             Replicas run concurrently, one per thread.  Without -t, uses min(K, cores) threads\n");
+    outmsg("   -f OFILE  With -e, write output of replica i to OFILE.i\n");
     full_exit(0);
 }
 
+#if !MPI
+/*
+  Run replicas of simulation with seeds global_seed .. global_seed+count-1.
+  They share the graph, and are run concurrently, one per thread.
+  Return elapsed time in seconds
+ */
+static double run_ensemble(state_t *s, int count, char *name, int steps, update_t update_mode,
+			   int dinterval, bool display) {
+    state_t *replica[count];
+    int i;
+    replica[0] = s;
+    for (i = 0; i < count; i++) {
+	if (i > 0) {
+	    replica[i] = clone_rats(s, s->global_seed + i);
+	    if (replica[i] == NULL)
+		full_exit(1);
+	    replica[i]->output_mode = s->output_mode;
+	    replica[i]->group_rats = s->group_rats;
+	    if (s->rat_id == NULL)
+		compact_rats(replica[i]);
+	}
+	if (display) {
+	    char fname[strlen(name) + 16];
+	    sprintf(fname, "%s.%d", name, i);
+	    replica[i]->out_file = fopen(fname, "w");
+	    if (replica[i]->out_file == NULL) {
+		outmsg("Couldn't open output file %s\n", fname);
+		full_exit(1);
+	    }
+	}
+    }
+    outmsg("Running ensemble of %d replicas (seeds %u .. %u)\n", count,
+	   (unsigned) s->global_seed, (unsigned) (s->global_seed + count - 1));
+    double start = currentSeconds();
+    /* Replicas run in parallel.  Loops within each simulation are then run by single threads */
+#pragma omp parallel for schedule(dynamic)
+    for (i = 0; i < count; i++) {
+	simulate(replica[i], steps, update_mode, dinterval, display);
+	if (display) {
+	    done(replica[i]);
+	    fclose(replica[i]->out_file);
+	}
+	if (i > 0)
+	    free_rats(replica[i]);
+    }
+    return currentSeconds() - start;
+}
+#endif
+
 int main(int argc, char *argv[]) {
     FILE *gfile = NULL;
     FILE *rfile = NULL;
@@ -39,6 +110,22 @@ int main(int argc, char *argv[]) {
     state_t *s = NULL;
     bool display = true;
     int process_count = 1;
+    int thread_count = 1;
+    bool threads_given = false;
+    output_t output_mode = OUTPUT_TEXT;
+    reorder_t reorder = REORDER_NONE;
+    bool group_rats = false;
+    bool profile = false;
+    char *checkpoint_name = NULL;
+    int checkpoint_interval = 0;
+    char *restart_name = NULL;
+    bool stats = false;
+    FILE *stat_file = NULL;
+    bool balance = false;
+    int balance_interval = 0;
+    int ensemble = 1;
+    char *ensemble_name = NULL;
+    uint64_t start;
     int this_zone = 0;
 #if MPI
     MPI_Init(NULL, NULL);
@@ -47,7 +134,7 @@ int main(int argc, char *argv[]) {
 #endif
     int nzone = process_count;
     bool mpi_master = this_zone == 0;
-    char *optstring = "hg:r:R:n:s:i:q";
+    char *optstring = "hg:r:R:n:s:i:qt:u:o:O:lPc:k:C:S:B:e:f:";
     while ((c = getopt(argc, argv, optstring)) != -1) {
         switch(c) {
         case 'h':
@@ -82,6 +169,81 @@ int main(int argc, char *argv[]) {
         case 'i':
             dinterval = atoi(optarg);
             break;
+        case 't':
+            thread_count = atoi(optarg);
+            threads_given = true;
+            break;
+        case 'u':
+            if (strcmp(optarg, "s") == 0)
+                update_mode = UPDATE_SYNCHRONOUS;
+            else if (strcmp(optarg, "b") == 0)
+                update_mode = UPDATE_BATCH;
+            else if (strcmp(optarg, "r") == 0)
+                update_mode = UPDATE_RAT;
+            else {
+                if (!mpi_master) break;
+                outmsg("Unknown update mode '%s'\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'o':
+            if (strcmp(optarg, "t") == 0)
+                output_mode = OUTPUT_TEXT;
+            else if (strcmp(optarg, "b") == 0)
+                output_mode = OUTPUT_BINARY;
+            else if (strcmp(optarg, "d") == 0)
+                output_mode = OUTPUT_DELTA;
+            else {
+                if (!mpi_master) break;
+                outmsg("Unknown output format '%s'\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'O':
+            if (strcmp(optarg, "r") == 0)
+                reorder = REORDER_RCM;
+            else if (strcmp(optarg, "z") == 0)
+                reorder = REORDER_ZONE;
+            else {
+                if (!mpi_master) break;
+                outmsg("Unknown node ordering '%s'\n", optarg);
+                usage(argv[0]);
+            }
+            break;
+        case 'l':
+            group_rats = true;
+            break;
+        case 'P':
+            profile = true;
+            break;
+        case 'c':
+            checkpoint_name = optarg;
+            break;
+        case 'k':
+            checkpoint_interval = atoi(optarg);
+            break;
+        case 'C':
+            restart_name = optarg;
+            break;
+        case 'S':
+            stats = true;
+            if (!mpi_master) break;
+            stat_file = strcmp(optarg, "-") == 0 ? stderr : fopen(optarg, "w");
+            if (stat_file == NULL) {
+                outmsg("Couldn't open statistics file %s\n", optarg);
+		full_exit(1);
+            }
+            break;
+        case 'B':
+            balance = true;
+            balance_interval = atoi(optarg);
+            break;
+        case 'e':
+            ensemble = atoi(optarg);
+            break;
+        case 'f':
+            ensemble_name = optarg;
+            break;
         default:
             if (!mpi_master) break;
             outmsg("Unknown option '%c'\n", c);
@@ -89,57 +251,139 @@ int main(int argc, char *argv[]) {
         }
     }
 
+#ifdef _OPENMP
+    /* Ensemble replicas run one per thread.  Unless told otherwise, use as many threads as can run at once */
+    if (ensemble > 1 && !threads_given) {
+	thread_count = omp_get_max_threads();
+	if (thread_count > ensemble)
+	    thread_count = ensemble;
+    }
+    if (thread_count > 0)
+	omp_set_num_threads(thread_count);
+#else
+    if (thread_count > 1 && mpi_master)
+	outmsg("Compiled without OpenMP.  Running with 1 thread\n");
+    if (ensemble > 1 && mpi_master)
+	outmsg("Compiled without OpenMP.  Replicas will run one after another\n");
+#endif
+
+    if (ensemble > 1 && mpi_master) {
+	if (process_count > 1 || checkpoint_name != NULL || restart_name != NULL || stats) {
+	    outmsg("Ensemble runs in single process, without checkpoints or statistics\n");
+	    full_exit(1);
+	}
+	if (display && ensemble_name == NULL) {
+	    outmsg("Ensemble needs output file name (-f) unless quiet\n");
+	    full_exit(1);
+	}
+    }
+
+    if (profile)
+	start_profile();
+
     if (mpi_master) {
       	if (gfile == NULL) {
 	    outmsg("Need graph file\n");
 	    usage(argv[0]);
 	}
-	if (rfile == NULL) {
+	if (rfile == NULL && restart_name == NULL) {
 	    outmsg("Need initial rat position file\n");
 	    usage(argv[0]);
 	}
+	start = phase_start();
 	g = read_graph(gfile, nzone);
-	if (g == NULL) {
+	if (g == NULL || !reorder_graph(g, reorder)) {
 	    full_exit(1);
 	}
-	s = read_rats(g, rfile, global_seed);
+	phase_end(PHASE_GRAPH_LOAD, start);
+	start = phase_start();
+	if (restart_name != NULL)
+	    s = read_checkpoint(g, restart_name);
+	else
+	    s = read_rats(g, rfile, global_seed);
 	if (s == NULL) {
 	    full_exit(1);
 	}
-        /* Master distributes the graph to the other processors */
-#if MPI
-	send_graph(g);
-	if (!setup_zone(g, this_zone))
+	phase_end(PHASE_RAT_LOAD, start);
+	if (balance && nzone > 1 && !assign_zones_by_load(s))
 	    full_exit(1);
-	// TODO:
-	// * Set up other zone-specific data structures
-	// * Distribute copy of rats to other zones
+        /* Master distributes the graph and the rats to the other processors */
+#if MPI
+	start = phase_start();
+	/* Reassigning zones during the run requires the full graph in every process */
+	if (balance_interval > 0)
+	    send_graph(g);
+	else
+	    send_subgraphs(g);
+	phase_end(PHASE_GRAPH_LOAD, start);
+	start = phase_start();
+	send_rats(s);
+	phase_end(PHASE_RAT_LOAD, start);
 #endif
     } else {
-	/* The other nodes receive the graph from the master */
+	/* The other nodes receive the graph and the rats from the master */
 #if MPI
-	g = get_graph();
+	start = phase_start();
+	g = balance_interval > 0 ? get_graph() : get_subgraph();
 	if (g == NULL) {
 	    full_exit(0);
 	}
-	if (!setup_zone(g, this_zone))
+	phase_end(PHASE_GRAPH_LOAD, start);
+	start = phase_start();
+	s = get_rats(g);
+	if (s == NULL) {
 	    full_exit(0);
-	// TODO:
-	// * Set up other zone-specific data structures
-	// * Receive copy of rats from process 0
+	}
+	phase_end(PHASE_RAT_LOAD, start);
 #endif
     }
+    start = phase_start();
+    if (!setup_zone(g, this_zone))
+	full_exit(1);
+    phase_end(PHASE_GRAPH_LOAD, start);
+#if MPI
+    /* Each process keeps only the rats in its zone */
+    start = phase_start();
+    if (!setup_zone_state(s))
+	full_exit(1);
+    phase_end(PHASE_RAT_LOAD, start);
+#endif
+
+    s->output_mode = output_mode;
+    s->group_rats = group_rats;
+    s->checkpoint_name = checkpoint_name;
+    s->checkpoint_interval = checkpoint_interval > 0 ? checkpoint_interval : steps;
+    s->stats = stats;
+    s->stat_file = stat_file;
+    s->balance_interval = balance_interval;
+    /* Rat Ids are stored only when they can't be implied by rat order */
+    compact_rats(s);
+    if (!set_update_mode(s, update_mode))
+	full_exit(1);
+    report_memory(s);
 
-    if (mpi_master)
-	outmsg("Running with %d processes.\n", process_count);
+    if (mpi_master) {
+	outmsg("Running with %d processes, %d threads/process.\n", process_count, thread_count);
+	if (WEIGHT_FLOAT)
+	    outmsg("Using single-precision weights\n");
+    }
 
-    if (mpi_master)
-	// Right now, run sequential simulator on master node
-	// TODO: All processes should run simulator on their zones
-	secs = simulate(s, steps, update_mode, dinterval, display);
+#if !MPI
+    if (ensemble > 1) {
+	secs = run_ensemble(s, ensemble, ensemble_name, steps, update_mode, dinterval, display);
+	outmsg("%d replicas, %d steps, %d rats, %.3f seconds\n", ensemble, steps, s->nrat, secs);
+	show_profile(process_count, thread_count);
+	return 0;
+    }
+#endif
+    secs = simulate(s, steps, update_mode, dinterval, display);
+    done(s);
     if (mpi_master) {
 	outmsg("%d steps, %d rats, %.3f seconds\n", steps, s->nrat, secs);
     }
+    show_profile(process_count, thread_count);
+    if (stat_file != NULL && stat_file != stderr)
+	fclose(stat_file);
 #if MPI
     MPI_Finalize();
 #endif    
@@ -12,11 +12,18 @@
 #include <string.h>
 #include <ctype.h>
 #include <math.h>
+#include <stdint.h>
+#include <inttypes.h>
 
 #if MPI
 #include <mpi.h>
 #endif
 
+/* Multithreading enabled when compiled with OpenMP */
+#ifdef _OPENMP
+#include <omp.h>
+#endif
+
 /* Optionally enable debugging routines */
 #ifndef DEBUG
 #define DEBUG 0
@@ -33,6 +40,32 @@
 #include "rutil.h"
 #include "cycletimer.h"
 
+/*
+  Precision of node weights and their region sums.  Compiling with
+  -DWEIGHT_FLOAT stores them as single precision, halving the memory
+  traffic of the sums at the cost of results that drift from the
+  double-precision reference (see divergence.py)
+ */
+#ifndef WEIGHT_FLOAT
+#define WEIGHT_FLOAT 0
+#endif
+
+#if WEIGHT_FLOAT
+typedef float weight_t;
+#define MPI_WEIGHT MPI_FLOAT
+#else
+typedef double weight_t;
+#define MPI_WEIGHT MPI_DOUBLE
+#endif
+
+/*
+  Rat counts are stored as count_t while every node's count fits,
+  halving their space and memory traffic.  When some count would
+  exceed COUNT_MAX, they are widened to int for the rest of the run
+ */
+typedef uint16_t count_t;
+#define COUNT_MAX UINT16_MAX
+
 
 /*
   Definitions of all constant parameters.  This would be a good place
@@ -42,6 +75,14 @@
 /* What is the maximum line length for reading files */
 #define MAXLINE 1024
 
+/* Text files are parsed in parallel, in chunks of at least this many bytes */
+#define TEXT_CHUNK (1 << 16)
+
+/* Identifiers at the start of binary graph and rat files */
+#define GRAPH_MAGIC "GRG1"
+#define RAT_MAGIC "GRR1"
+#define CHECKPOINT_MAGIC "GRC1"
+
 /* What is the batch size as a fraction of the number of rats */
 #define BATCH_FRACTION 0.02
 
@@ -51,10 +92,83 @@
 /* What is the crossover between binary and linear search */
 #define BINARY_THRESHOLD 4
 
+/* Number of load bins in statistics histogram */
+#define STAT_BINS 8
+
+/*
+  Moves within a batch are computed in chunks of at most this many rats,
+  bounding the space for per-rat move buffers (synchronous mode has all R rats in one batch)
+ */
+#define MOVE_CHUNK 65536
+
+/* Recompute weights only for nodes near those whose rat counts changed */
+#define INCREMENTAL_UPDATE 1
+
+/* Above what fraction of changed nodes should all weights be recomputed */
+#define INCREMENTAL_FRACTION 0.25
+
+/*
+  Estimated cost of simulating a node, each of its edges, and each of its rats.
+  Used when assigning file zones to processes by load
+ */
+#define COST_NODE 2
+#define COST_EDGE 1
+#define COST_RAT 4
+
+/*
+  Partitioning of graphs lacking zones: coarsen until this many nodes remain,
+  allowing each bisection to deviate from its target cost by this fraction of
+  the total, with this many refinement passes per level, this many initial
+  splits, and at most this many levels
+ */
+#define PARTITION_COARSEN 100
+#define PARTITION_TOLERANCE 0.01
+#define PARTITION_PASSES 8
+#define PARTITION_TRIES 4
+#define PARTITION_LEVELS 64
+
+/* Minimum number of loop iterations worth dividing among threads */
+#define PARALLEL_THRESHOLD 1024
+
+/* Imbalance values are tabulated for pairs of counts below this limit */
+#define IMBALANCE_LIMIT 256
+
+/* Count ratio beyond which imbalance() is certain to reach its cutoff of 1.0 (log10 11 > 1) */
+#define IMBALANCE_CLIP_RATIO 11.0
+
+/*
+  Nodes with at least this many neighbors (hubs) save the imbalance with each neighbor,
+  and their regions use branch-free binary search
+ */
+#define HUB_THRESHOLD 32
+
+/*
+  Number of entries (a power of 2) in each thread's cache of computed weights.  0 disables cache.
+  Hit rates are high only on small graphs, and so it is disabled by default.
+  Enable with "make WCACHE=64"
+ */
+#ifndef WEIGHT_CACHE_SIZE
+#define WEIGHT_CACHE_SIZE 0
+#endif
+
+#if WEIGHT_CACHE_SIZE & (WEIGHT_CACHE_SIZE-1)
+#error "WEIGHT_CACHE_SIZE must be a power of 2"
+#endif
+
 
 /* Update modes */
 typedef enum { UPDATE_SYNCHRONOUS, UPDATE_BATCH, UPDATE_RAT } update_t;
 
+/* Formats for showing rat counts: text, binary, or binary changes since last shown */
+typedef enum { OUTPUT_TEXT, OUTPUT_BINARY, OUTPUT_DELTA } output_t;
+
+/* Node renumberings for locality: none, reverse Cuthill-McKee, or zone-major */
+typedef enum { REORDER_NONE, REORDER_RCM, REORDER_ZONE } reorder_t;
+
+/* Phases of execution tracked when profiling */
+typedef enum { PHASE_GRAPH_LOAD, PHASE_RAT_LOAD, PHASE_CENSUS, PHASE_GROUP, PHASE_SUMS,
+	       PHASE_MOVES, PHASE_WEIGHTS, PHASE_COMM, PHASE_OUTPUT, PHASE_CHECKPOINT, NPHASE } phase_t;
+
 /* All information needed for graphrat simulation */
 
 /* Parameter abbreviations
@@ -67,6 +181,41 @@ typedef enum { UPDATE_SYNCHRONOUS, UPDATE_BATCH, UPDATE_RAT } update_t;
  */
 
 
+/*
+  Header of binary graph file.  Followed by int32 arrays
+  neighbor_start (N+1), neighbor (M+N), and file zone ids (N)
+ */
+typedef struct {
+    char magic[4];
+    int32_t nnode;
+    int32_t nedge;
+    int32_t nzone;
+} graph_header_t;
+
+/* Header of binary rat file.  Followed by int32 array of rat positions (R) */
+typedef struct {
+    char magic[4];
+    int32_t nnode;
+    int32_t nrat;
+    int32_t pad;
+} rat_header_t;
+
+/*
+  Header of checkpoint file, holding state of rats in one or more zones after a step.
+  Followed by int32 arrays of rat ids, positions, and seeds (count each)
+ */
+typedef struct {
+    char magic[4];
+    int32_t nnode;
+    int32_t nrat;
+    int32_t step;
+    // Number of shards, and which one this is
+    int32_t nshard;
+    int32_t shard;
+    int32_t count;
+    uint32_t global_seed;
+} checkpoint_header_t;
+
 /* Representation of graph */
 typedef struct {
     /* General parameters */
@@ -81,6 +230,34 @@ typedef struct {
     int *neighbor_start;
     // For each node, zone identifier (number between 0 and Z-1).  Length=N
     int *zone_id;
+    /* Zones as given in the graph file.  Each zone consists of one or more file zones */
+    int nfzone;
+    // For each node, file zone identifier.  Length=N
+    int *fzone_id;
+    /*
+      Optional renumbering of nodes for locality.  Rat files, checkpoints
+      and displayed counts always use the node numbers from the graph file.
+      In the full graph, both NULL when nodes keep their file numbering.
+      A subgraph always has file_nid, giving the file numbers of its nodes
+      for writing checkpoint shards, but never graph_nid, since only
+      process 0 reads node numbers from files
+     */
+    // For each node, its number in the file.  Length=N
+    int *file_nid;
+    // For each node number in the file, the node.  Length=N
+    int *graph_nid;
+    /*
+      Rank-local subgraph, holding one zone's nodes plus a one-hop halo
+      of their neighbors in other zones.  Nodes are numbered in the same
+      order as in the full graph.  NULL for the full graph
+     */
+    // For each node, its number in the full graph.  Length=N
+    int *global_nid;
+    // Number of nodes in the full graph
+    int global_nnode;
+    /* Graph loaded from binary file has arrays mapped directly from file */
+    void *map_base;
+    size_t map_length;
 #if STATIC_ILF
     // NOTE: This data removed.  ILFs are computed dynamically
     // Ideal load factor for each node.  (This value gets read from file but is not used.)  Length=N
@@ -104,6 +281,22 @@ typedef struct {
 
 } graph_t;
 
+#if MPI
+/* Growable buffer of ints, used for messages of varying length */
+typedef struct {
+    int *data;
+    int count;
+    int capacity;
+} ibuf_t;
+#endif
+
+/* Cached result of weight computation */
+typedef struct {
+    int count;
+    double ilf;
+    double weight;
+} weight_cache_t;
+
 /* Representation of simulation state */
 typedef struct {
     graph_t *g;
@@ -115,74 +308,453 @@ typedef struct {
     /* Random seed controlling simulation */
     random_t global_seed;
 
+    /* Checkpointing */
+    // Number of steps already simulated (nonzero when restarting from checkpoint)
+    int start_step;
+    // Rat seeds restored from checkpoint rather than generated
+    bool restored;
+    // File name for checkpoints, or NULL
+    char *checkpoint_name;
+    // Steps between checkpoints
+    int checkpoint_interval;
+
+    /* Load balancing */
+    // Reassign file zones to processes by load every this many steps (0 = never)
+    int balance_interval;
+
+    /* Load statistics, maintained incrementally as rats move */
+    // Print statistics each step
+    bool stats;
+    // Where to print them (process 0 only)
+    FILE *stat_file;
+    // For each count value, number of local nodes having that count.  Grows as needed
+    int *stat_count_hist;
+    int stat_hist_capacity;
+    // Sum of squared counts of local nodes
+    int64_t stat_sum_sq;
+    // Smallest and largest counts of local nodes
+    int stat_min;
+    int stat_max;
+    // Number of rats in each file zone (only local nodes counted).  Length = max(1, file zones)
+    int *stat_zone_total;
+
     /* State representation */
-    // Node Id for each rat.  Length=R
+    /* Only rats in this zone are represented.  Indexed by local rat number */
+    // Number of rats in this zone.  With one zone, equals R.
+    int local_rat_count;
+    // Space allocated for local rats
+    int local_rat_capacity;
+    // Global Id for each rat, in increasing order.  Length=local_rat_count
+    // NULL when implied by rat order (single zone, rats not grouped), with rat ri having Id ri
+    int *rat_id;
+    // Node Id for each rat.  Length=local_rat_count
     int *rat_position;
-    // Rat seeds.  Length = R
+    // Rat seeds.  Length=local_rat_count
     random_t *rat_seed;
 
     /* Redundant encodings to speed computation */
     // Count of number of rats at each node.  Length = N.
+    // Held in short_count while all counts fit in count_t, and in rat_count once widened.
+    // Exactly one of the two is non-NULL.  Use node_count() and set_node_count()
+    count_t *short_count;
     int *rat_count;
     // Store weights for each node.  Length = N
-    double *node_weight;
+    weight_t *node_weight;
+
+    /* Incremental weight computation */
+    // Nodes whose counts changed since weights were last computed.  Length = N
+    int *count_changed_list;
+    int count_changed_count;
+    // Membership flags for count_changed_list.  Length = N
+    bool *count_changed;
+    // Nodes whose weights changed since region sums were last computed.  Length = N
+    int *weight_changed_list;
+    int weight_changed_count;
+    // Membership flags for weight_changed_list.  Length = N
+    bool *weight_changed;
+    // Set when all weights have been recomputed
+    bool all_weights_changed;
+    // Nodes whose region sums must be recomputed.  Length = N
+    int *sum_changed_list;
+    // Membership flags for sum_changed_list.  Length = N
+    // With lazy_sums, indicates that region sums are stale
+    bool *sum_changed;
+    // Rebuild region sums only when a rat needs them (rat-order mode)
+    bool lazy_sums;
 
     /* Computed parameters */
     double load_factor;  // nrat/nnnode
-    int batch_size;   // Batch size for batch mode
+    int batch_size;   // Batch size for current update mode
+
+    // New node for each rat in current chunk of batch.  Length = min(B, MOVE_CHUNK)
+    int *next_move;
+    // Random value in [0.0, 1.0) drawn for each rat in current chunk.  Length = min(B, MOVE_CHUNK)
+    double *random_value;
+
+    /* Optional grouping of rats by node within each batch */
+    bool group_rats;
+    // Number of local rats for which grouping space allocated
+    int group_capacity;
+    // Ordering of local rats.  Length = group_capacity
+    int *group_order;
+    // Alternate space for ordering and for permuting rat data.  Length = group_capacity
+    int *group_scratch;
+    random_t *group_seed_scratch;
+    // Counting-sort buckets.  Length = max(N, number of batches) + 1
+    int *group_bucket;
+
+    /* Output */
+    output_t output_mode;
+    // Where steps are shown.  stdout, except for replicas in an ensemble
+    FILE *out_file;
+    // Space to format each step.  Allocated on first use
+    char *output_buffer;
+    // Counts when last shown, used for showing changes.  Length = N
+    int *last_count;
+
+    /* Precomputed values to avoid transcendental functions */
+    // Counts below this value have tabulated imbalance values
+    int imbalance_limit;
+    // Imbalance for each pair of counts.  Length = imbalance_limit^2
+    double *imbalance_table;
+    // Cache of recent weight computations for each thread.  Length = T * WEIGHT_CACHE_SIZE
+    weight_cache_t *weight_cache;
+    // For nodes with at least HUB_THRESHOLD neighbors (hubs),
+    // imbalance with each neighbor, and neighbor count used to compute it.
+    // Stored only for hubs.  Length = total outdegree of hubs
+    double *hub_imbalance;
+    int *hub_imbalance_rcount;
+    // Where each hub's entries start in these arrays.  Length = N
+    int *hub_imbalance_start;
+    int hub_imbalance_count;
+    // Hub's own count when imbalances computed, or -1.  Length = N
+    int *hub_imbalance_lcount;
 
     /** Mode-specific data structures **/
     // Synchronous and batch mode
     // Memory to store sum of weights for each node's region.  Length = N
-    double *sum_weight;
+    weight_t *sum_weight;
     // Memory to store cummulative weights for each node's region.  Length = M+N
-    double *neighbor_accum_weight;
-
+    weight_t *neighbor_accum_weight;
 
-    // TODO: Declare the data structures you need to:
-    // * Keep track of the rats in this zone
-    // * Have storage for buffers you use to communicate with other zones
+#if MPI
+    /* Communication with other zones */
+    // For each zone z, (id, node, seed) triples for rats moving to z.  Length = Z
+    ibuf_t *export_rat_buffer;
+    // (id, node, seed) triples for rats that arrived during the current step
+    ibuf_t import_rat_buffer;
+    // For each zone z, counts and weights of exported nodes.  Length = Z
+    int **export_count_buffer;
+    weight_t **export_weight_buffer;
+    // For each zone z, counts and weights of imported nodes.  Length = Z
+    int **import_count_buffer;
+    weight_t **import_weight_buffer;
+    // Pending requests.  Length = 2*Z
+    MPI_Request *request;
+    // Process 0 only: nodes ordered by zone, and buffers for gathering their counts
+    int *gather_node_list;
+    int *gather_count_buffer;
+    int *gather_zone_count;
+    int *gather_zone_start;
+#endif
 } state_t;
     
 
 /*** Functions in graph.c. ***/
 graph_t *new_graph(int nnode, int nedge, int nzone);
 
-void free_graph();
+void free_graph(graph_t *g);
 
 graph_t *read_graph(FILE *gfile, int nzone);
 
+/* Assign file zones to zones in contiguous blocks */
+bool assign_zones(graph_t *g);
+
+/* Add estimated cost of simulating nodes in list (all when NULL), and rats at positions, to cost of their file zones */
+void fzone_cost(graph_t *g, int *list, int nlist, int *position, int nrat, int64_t *cost);
+
+/* Assign file zones to zones to balance costs.  Sets *changed if assignment differs from current one */
+bool balance_zones(graph_t *g, int64_t *cost, bool verbose, bool *changed);
+
+/* Store graph in binary format */
+bool write_graph_binary(graph_t *g, FILE *outfile);
+
+/* Renumber nodes to improve locality */
+bool reorder_graph(graph_t *g, reorder_t mode);
+
+/*
+  Convert between node numbers in graph file and internal node numbers.
+  graph_node() applies only to the full graph
+ */
+static inline int graph_node(graph_t *g, int fnid) {
+    return g->graph_nid == NULL ? fnid : g->graph_nid[fnid];
+}
+
+static inline int file_node(graph_t *g, int nid) {
+    return g->file_nid == NULL ? nid : g->file_nid[nid];
+}
+
+/* Convert between node numbers in subgraph and in full graph */
+static inline int global_node(graph_t *g, int nid) {
+    return g->global_nid == NULL ? nid : g->global_nid[nid];
+}
+
+/* Returns -1 if node not in subgraph */
+static inline int subgraph_node(graph_t *g, int gnid) {
+    if (g->global_nid == NULL)
+	return gnid;
+    int left = 0;
+    int right = g->nnode;
+    while (left < right) {
+	int mid = left + (right-left)/2;
+	if (g->global_nid[mid] < gnid)
+	    left = mid+1;
+	else
+	    right = mid;
+    }
+    return left < g->nnode && g->global_nid[left] == gnid ? left : -1;
+}
+
 #if DEBUG
 void show_graph(graph_t *g);
 #endif
 
 #if MPI
+/* Every process gets the full graph */
 void send_graph(graph_t *g);
 graph_t *get_graph();
+/* Each process gets the subgraph for its zone */
+void send_subgraphs(graph_t *g);
+graph_t *get_subgraph();
 #endif
 
 bool setup_zone(graph_t *g, int this_zone);
+void clear_zone(graph_t *g);
 
 /*** Functions in simutil.c ***/
 /* Print message on stderr */
 void outmsg(char *fmt, ...);
 
-/* Allocate and zero arrays of int/double */
+/* Allocate and zero arrays of int/double/weight_t/bool/random_t */
 int *int_alloc(size_t n);
 double *double_alloc(size_t n);
+weight_t *weight_alloc(size_t n);
+bool *bool_alloc(size_t n);
+random_t *rt_alloc(size_t n);
 
 
 /* Read rat file and initialize simulation state */
 state_t *read_rats(graph_t *g, FILE *infile, random_t global_seed);
 
+#if !MPI
+/* Copy initial rat positions into new simulation state with different seed, for an ensemble */
+state_t *clone_rats(state_t *s, random_t global_seed);
 
-/* Comparison function for qsort */
+/* Free simulation state, but not its graph */
+void free_rats(state_t *s);
+#endif
+
+/* Store initial rat positions in binary format */
+bool write_rats_binary(state_t *s, FILE *outfile);
+
+/*
+  Write positions and seeds of local rats after step.
+  With multiple zones, each writes its own shard NAME.Z
+ */
+bool write_checkpoint(state_t *s, int step);
+
+/*
+  Initialize simulation state from checkpoint, reading all shards.
+  Number of zones need not match that when written
+ */
+state_t *read_checkpoint(graph_t *g, char *name);
+
+/* Check whether file starts with magic identifier of binary file.  Rewind if not */
+bool binary_file(FILE *infile, char *magic);
+
+/* Map entire file into memory.  Return NULL if fails */
+void *map_file(FILE *infile, size_t *lengthp);
+
+/*
+  Text file held in memory as a single string.  Records (lines other
+  than comments and blank lines) following the header line are divided
+  into chunks of whole lines that can be parsed in parallel.
+ */
+typedef struct {
+    char *text;
+    // First record of file, giving counts
+    char header[MAXLINE];
+    int nchunk;
+    // Start of each chunk, plus end of text.  Length = nchunk+1
+    char **chunk_start;
+    // Index of first record in chunk, plus total record count.  Length = nchunk+1
+    int *chunk_record;
+    // Line number of first line in chunk.  Length = nchunk
+    int *chunk_line;
+    // Error message from parsing each chunk.  Length = nchunk * MAXLINE
+    char *chunk_error;
+} text_t;
+
+/* Read entire file and locate records.  Return false if fails */
+bool read_text(FILE *infile, text_t *t);
+void free_text(text_t *t);
+
+/* Buffer for error message from parsing chunk c */
+static inline char *text_error(text_t *t, int c) {
+    return t->chunk_error + (size_t) c * MAXLINE;
+}
+
+/* Print first error from parsing chunks, if any.  Return true if there were none */
+bool text_ok(text_t *t);
+
+/* Skip spaces and tabs */
+static inline char *skip_blank(char *pos) {
+    while (*pos == ' ' || *pos == '\t' || *pos == '\r')
+	pos++;
+    return pos;
+}
+
+/* Does line start with a record, rather than being blank or a comment? */
+static inline bool is_record(char *pos) {
+    char c = *skip_blank(pos);
+    return c != '#' && c != '\n' && c != '\0';
+}
+
+/* Start of line following pos */
+static inline char *next_line(char *pos) {
+    char *nl = strchr(pos, '\n');
+    return nl == NULL ? pos + strlen(pos) : nl + 1;
+}
+
+/* Scan for given character, after optional blanks.  Return NULL if not found */
+static inline char *scan_char(char *pos, char c) {
+    pos = skip_blank(pos);
+    return *pos == c ? pos + 1 : NULL;
+}
+
+/* Scan decimal integer, after optional blanks.  Return NULL if not found */
+static inline char *scan_int(char *pos, int *valp) {
+    if (pos == NULL)
+	return NULL;
+    pos = skip_blank(pos);
+    bool neg = *pos == '-';
+    if (*pos == '-' || *pos == '+')
+	pos++;
+    if (*pos < '0' || *pos > '9')
+	return NULL;
+    int64_t val = 0;
+    while (*pos >= '0' && *pos <= '9') {
+	val = 10 * val + (*pos++ - '0');
+	if (val > (int64_t) INT32_MAX + 1)
+	    return NULL;
+    }
+    if (!neg && val > INT32_MAX)
+	return NULL;
+    *valp = (int) (neg ? -val : val);
+    return pos;
+}
+
+/*
+  Scan floating-point number, after optional blanks.  Return NULL if not found.
+  Plain decimals with few digits are converted exactly; others are passed to strtod
+ */
+static inline char *scan_double(char *pos, double *valp) {
+    static const double power10[] = { 1e0, 1e1, 1e2, 1e3, 1e4, 1e5, 1e6, 1e7, 1e8, 1e9, 1e10,
+				      1e11, 1e12, 1e13, 1e14, 1e15 };
+    if (pos == NULL)
+	return NULL;
+    pos = skip_blank(pos);
+    char *start = pos;
+    bool neg = *pos == '-';
+    if (*pos == '-' || *pos == '+')
+	pos++;
+    int64_t mant = 0;
+    int ndigit = 0;
+    int nfrac = 0;
+    while (*pos >= '0' && *pos <= '9') {
+	mant = 10 * mant + (*pos++ - '0');
+	ndigit++;
+    }
+    if (*pos == '.') {
+	pos++;
+	while (*pos >= '0' && *pos <= '9') {
+	    mant = 10 * mant + (*pos++ - '0');
+	    ndigit++;
+	    nfrac++;
+	}
+    }
+    if (ndigit == 0 || ndigit > 15 || *pos == 'e' || *pos == 'E') {
+	char *end;
+	*valp = strtod(start, &end);
+	return end == start ? NULL : end;
+    }
+    /* Both operands exact, so quotient is correctly rounded */
+    double val = (double) mant / power10[nfrac];
+    *valp = neg ? -val : val;
+    return pos;
+}
+
+#if MPI
+/* Called by process 0 to scatter rats by zone, with seeds when restored from checkpoint */
+void send_rats(state_t *s);
+/* Called by other processes to receive the rats in their zones */
+state_t *get_rats(graph_t *g);
+/* Keep only rats in this zone, seed them, and set up communication buffers */
+bool setup_zone_state(state_t *s);
+/* Make space for at least n local rats */
+bool grow_rats(state_t *s, int n);
+/* Make space for at least n values in buffer */
+void ibuf_reserve(ibuf_t *buf, int n);
+/* Reallocate buffers for boundary exchanges after zones have been reassigned */
+bool reset_zone_buffers(state_t *s);
+#endif
+
+/* Called by process 0 before distributing graph: assign file zones by initial rat positions */
+bool assign_zones_by_load(state_t *s);
+
+
+/* Comparison functions for qsort */
 int comp_int(const void *ap, const void *bp);
+int comp_int64(const void *ap, const void *bp);
 
 
 /* Generate done message from simulator */
 void done(state_t *s);
 
+/* Drop rat Ids when implied by rat order.  Returns false (keeping Ids) when not possible */
+bool compact_rats(state_t *s);
+
+/* Global Id of local rat ri */
+static inline int rat_number(state_t *s, int ri) {
+    return s->rat_id == NULL ? ri : s->rat_id[ri];
+}
+
+/* Switch counts from count_t to int, once some count no longer fits.  Exits if fails */
+void widen_counts(state_t *s);
+
+/* Number of rats at node nid */
+static inline int node_count(state_t *s, int nid) {
+    return s->rat_count == NULL ? s->short_count[nid] : s->rat_count[nid];
+}
+
+/* Set number of rats at node nid, first widening counts if it doesn't fit */
+static inline void set_node_count(state_t *s, int nid, int count) {
+    if (s->rat_count == NULL && count > COUNT_MAX)
+	widen_counts(s);
+    if (s->rat_count == NULL)
+	s->short_count[nid] = count;
+    else
+	s->rat_count[nid] = count;
+}
+
+/* Print estimate of memory used by graph and simulation state */
+void report_memory(state_t *s);
+
+/* Set up and print per-step load statistics */
+void init_stats(state_t *s);
+int *grow_stat_hist(state_t *s, int count);
+void show_stats(state_t *s, int step);
+
 /* Print state of simulation */
 /* show_counts indicates whether to include counts of rats for each node */
 void show(state_t *s, bool show_counts);
@@ -190,6 +762,45 @@ void show(state_t *s, bool show_counts);
 /* Prepare for weight computation */
 void init_sum_weight(state_t *s);
 
+/* Set up tables of imbalance values and cache of weights */
+bool init_weight_tables(state_t *s);
+
+/* Set batch size and allocate batch buffers for update mode */
+bool set_update_mode(state_t *s, update_t update_mode);
+
+/* Profiling data, accumulated only when enabled */
+extern bool profiling;
+extern uint64_t phase_ticks[NPHASE];
+extern long phase_calls[NPHASE];
+extern char *phase_name[NPHASE];
+
+/* Start profiling run */
+void start_profile();
+
+/* Get starting time for phase */
+static inline uint64_t phase_start() {
+    return profiling ? currentTicks() : 0;
+}
+
+/* Record time since start for phase.  Replicas of an ensemble may record concurrently */
+static inline void phase_end(phase_t phase, uint64_t start) {
+    if (profiling) {
+	uint64_t ticks = currentTicks() - start;
+#pragma omp atomic
+	phase_ticks[phase] += ticks;
+#pragma omp atomic
+	phase_calls[phase]++;
+    }
+}
+
+/* Print breakdown of time by phase on stderr, as table and as JSON */
+void show_profile(int process_count, int thread_count);
+
+
+/*** Functions in partition.c ***/
+
+/* Divide nodes into nparts parts of similar cost, with few edges between them.  Returns number of edges cut */
+int partition_graph(graph_t *g, int nparts, int *part);
 
 /*** Functions in sim.c ***/
 
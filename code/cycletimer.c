@@ -44,7 +44,7 @@ typedef uint64_t SysClock;
     //////////
     // Return the current CPU time, in terms of clock ticks.
     // Time zero is at some arbitrary point in the past.
-static SysClock currentTicks() {
+SysClock currentTicks() {
     //#if defined(__APPLE__) && !defined(__x86_64__)
 #if defined(__APPLE__)
       return mach_absolute_time();
@@ -69,7 +69,7 @@ static SysClock currentTicks() {
 
 //////////
 // Return the conversion from ticks to seconds.
-static double secondsPerTick() {
+double secondsPerTick() {
     static bool initialized = false;
     static double secondsPerTick_val;
     if (initialized) return secondsPerTick_val;
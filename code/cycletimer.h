@@ -1,6 +1,13 @@
 #ifndef CYCLETIMER_H
 /* Cycle timer code, adapted from CycleTimer.h found in 15-418 code repositories */
 
+#include <stdint.h>
+
 double currentSeconds();
+
+/* Low-overhead tick counter.  Time zero is at some arbitrary point in the past */
+uint64_t currentTicks();
+/* Conversion from ticks to seconds */
+double secondsPerTick();
 #define CYCLETIMER_H
 #endif
@@ -0,0 +1,135 @@
+#!/usr/bin/python
+
+# Measure how far the count trajectory of one simulation diverges from a reference.
+# Intended for comparing crun-seq-f32 (single-precision weights) against crun-seq,
+# but works for any two simulator outputs in text format over the same graph and rats.
+#
+# Example:
+#   ./crun-seq -g data/g-h180x180.gph -r data/r-180x180-u32.rats -n 50 > ref.txt
+#   ./crun-seq-f32 -g data/g-h180x180.gph -r data/r-180x180-u32.rats -n 50 > test.txt
+#   ./divergence.py ref.txt test.txt
+
+import sys
+import math
+import getopt
+
+def usage(fname):
+    sys.stdout.write("Usage: %s [-h] [-q] REFFILE TESTFILE\n" % fname)
+    sys.stdout.write("    -h       Print this message\n")
+    sys.stdout.write("    -q       Only print summary\n")
+    sys.stdout.write("  For each step, reports:\n")
+    sys.stdout.write("    moved:  Fraction of rats that would have to move to turn one set of counts into the other\n")
+    sys.stdout.write("    maxdiff: Largest difference in count at any node\n")
+    sys.stdout.write("    rel-l2: L2 norm of count differences, relative to L2 norm of reference counts\n")
+    sys.exit(0)
+
+class DivergenceException(Exception):
+    msg = ""
+
+    def __init__(self, m):
+        self.msg = m
+
+    def __str__(self):
+        return self.msg
+
+# Generator yielding count list for each step of simulator output
+def readSteps(fname):
+    try:
+        f = open(fname, 'r')
+    except Exception:
+        raise DivergenceException("Couldn't open file '%s'" % fname)
+    lineNumber = 0
+    counts = None
+    for line in f:
+        lineNumber += 1
+        fields = line.split()
+        if len(fields) == 0:
+            continue
+        if fields[0] == "STEP":
+            if len(fields) != 3:
+                raise DivergenceException("%s, line %d: Malformed STEP line" % (fname, lineNumber))
+            nnode = int(fields[1])
+            counts = []
+        elif fields[0] == "END":
+            if counts is None:
+                raise DivergenceException("%s, line %d: END without STEP" % (fname, lineNumber))
+            if len(counts) not in [0, nnode]:
+                raise DivergenceException("%s, line %d: Expected %d counts, got %d" % (fname, lineNumber, nnode, len(counts)))
+            # Steps without counts leave display unchanged.  Skip them
+            if len(counts) > 0:
+                yield counts
+            counts = None
+        elif fields[0] == "DONE":
+            break
+        elif counts is not None:
+            try:
+                counts.append(int(fields[0]))
+            except ValueError:
+                raise DivergenceException("%s, line %d: Invalid count '%s'" % (fname, lineNumber, fields[0]))
+        else:
+            raise DivergenceException("%s, line %d: Unexpected line '%s' (only text output supported)" % (fname, lineNumber, line.strip()))
+    f.close()
+
+def compare(rcounts, tcounts):
+    if len(rcounts) != len(tcounts):
+        raise DivergenceException("Reference has %d nodes, but test has %d" % (len(rcounts), len(tcounts)))
+    nrat = sum(rcounts)
+    l1 = 0
+    maxdiff = 0
+    l2 = 0
+    rl2 = 0
+    for r, t in zip(rcounts, tcounts):
+        d = abs(r - t)
+        l1 += d
+        maxdiff = max(maxdiff, d)
+        l2 += d * d
+        rl2 += r * r
+    moved = 0.5 * l1 / nrat if nrat > 0 else 0.0
+    rel = math.sqrt(float(l2) / rl2) if rl2 > 0 else 0.0
+    return (moved, maxdiff, rel)
+
+def run(name, args):
+    quiet = False
+    optlist, args = getopt.getopt(args, "hq")
+    for (opt, val) in optlist:
+        if opt == '-h':
+            usage(name)
+        elif opt == '-q':
+            quiet = True
+    if len(args) != 2:
+        usage(name)
+    rsteps = readSteps(args[0])
+    tsteps = readSteps(args[1])
+    if not quiet:
+        sys.stdout.write("%6s %10s %8s %10s\n" % ("step", "moved", "maxdiff", "rel-l2"))
+    step = 0
+    firstStep = None
+    worst = (0.0, 0, 0.0)
+    final = worst
+    while True:
+        rcounts = next(rsteps, None)
+        tcounts = next(tsteps, None)
+        if rcounts is None or tcounts is None:
+            if rcounts is not None or tcounts is not None:
+                sys.stdout.write("Warning: outputs have different numbers of steps.  Compared first %d\n" % step)
+            break
+        final = compare(rcounts, tcounts)
+        if final[1] > 0 and firstStep is None:
+            firstStep = step
+        worst = tuple([max(w, f) for w, f in zip(worst, final)])
+        if not quiet:
+            sys.stdout.write("%6d %10.6f %8d %10.6f\n" % (step, final[0], final[1], final[2]))
+        step += 1
+    if firstStep is None:
+        sys.stdout.write("Identical over %d steps\n" % step)
+    else:
+        sys.stdout.write("First difference at step %d of %d\n" % (firstStep, step))
+        sys.stdout.write("Final: moved %.6f, maxdiff %d, rel-l2 %.6f\n" % final)
+        sys.stdout.write("Worst: moved %.6f, maxdiff %d, rel-l2 %.6f\n" % worst)
+
+if __name__ == "__main__":
+    try:
+        run(sys.argv[0], sys.argv[1:])
+    except DivergenceException as ex:
+        sys.stderr.write("Divergence check failed: %s\n" % str(ex))
+        sys.exit(1)
@@ -0,0 +1,79 @@
+/* Convert graph and rat files from text to binary format */
+
+#include <getopt.h>
+
+#include "crun.h"
+
+static void usage(char *name) {
+    char *use_string = "-g GFILE [-G BGFILE] [-r RFILE -R BRFILE]";
+    outmsg("Usage: %s %s\n", name, use_string);
+    outmsg("   -h         Print this message\n");
+    outmsg("   -g GFILE   Graph file (text or binary)\n");
+    outmsg("   -G BGFILE  Binary graph file to generate\n");
+    outmsg("   -r RFILE   Rat position file (text or binary)\n");
+    outmsg("   -R BRFILE  Binary rat position file to generate\n");
+    exit(0);
+}
+
+static FILE *open_file(char *name, char *mode) {
+    FILE *f = fopen(name, mode);
+    if (f == NULL) {
+	outmsg("Couldn't open file %s\n", name);
+	exit(1);
+    }
+    return f;
+}
+
+int main(int argc, char *argv[]) {
+    FILE *gfile = NULL;
+    FILE *rfile = NULL;
+    FILE *bgfile = NULL;
+    FILE *brfile = NULL;
+    int c;
+    char *optstring = "hg:G:r:R:";
+    while ((c = getopt(argc, argv, optstring)) != -1) {
+	switch(c) {
+	case 'h':
+	    usage(argv[0]);
+	    break;
+	case 'g':
+	    gfile = open_file(optarg, "r");
+	    break;
+	case 'G':
+	    bgfile = open_file(optarg, "w");
+	    break;
+	case 'r':
+	    rfile = open_file(optarg, "r");
+	    break;
+	case 'R':
+	    brfile = open_file(optarg, "w");
+	    break;
+	default:
+	    outmsg("Unknown option '%c'\n", c);
+	    usage(argv[0]);
+	}
+    }
+    if (gfile == NULL) {
+	outmsg("Need graph file\n");
+	usage(argv[0]);
+    }
+    if ((rfile == NULL) != (brfile == NULL)) {
+	outmsg("Need both rat file and binary rat file\n");
+	usage(argv[0]);
+    }
+    graph_t *g = read_graph(gfile, 1);
+    if (g == NULL)
+	exit(1);
+    if (bgfile != NULL) {
+	if (!write_graph_binary(g, bgfile))
+	    exit(1);
+	fclose(bgfile);
+    }
+    if (rfile != NULL) {
+	state_t *s = read_rats(g, rfile, DEFAULTSEED);
+	if (s == NULL || !write_rats_binary(s, brfile))
+	    exit(1);
+	fclose(brfile);
+    }
+    return 0;
+}
@@ -1,6 +1,7 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <stdbool.h>
+#include <sys/mman.h>
 
 #include "crun.h"
 
@@ -12,6 +13,15 @@ graph_t *new_graph(int nnode, int nedge, int nzone) {
     g->nnode = nnode;
     g->nedge = nedge;
     g->nzone = nzone;
+    g->nfzone = 0;
+    g->fzone_id = NULL;
+    g->zone_id = NULL;
+    g->map_base = NULL;
+    g->map_length = 0;
+    g->file_nid = NULL;
+    g->graph_nid = NULL;
+    g->global_nid = NULL;
+    g->global_nnode = nnode;
     g->neighbor = calloc(nnode + nedge, sizeof(int));
     ok = ok && g->neighbor != NULL;
     g->neighbor_start = calloc(nnode + 1, sizeof(int));
@@ -32,21 +42,18 @@ graph_t *new_graph(int nnode, int nedge, int nzone) {
 }
 
 void free_graph(graph_t *g) {
-    free(g->neighbor);
-    free(g->neighbor_start);
-    free(g);
-}
-
-/* See whether line of text is a comment */
-static inline bool is_comment(char *s) {
-    int i;
-    int n = strlen(s);
-    for (i = 0; i < n; i++) {
-	char c = s[i];
-	if (!isspace(c))
-	    return c == '#';
+    if (g->map_base != NULL) {
+	munmap(g->map_base, g->map_length);
+    } else {
+	free(g->neighbor);
+	free(g->neighbor_start);
+	free(g->fzone_id);
     }
-    return false;
+    free(g->zone_id);
+    free(g->file_nid);
+    free(g->graph_nid);
+    free(g->global_nid);
+    free(g);
 }
 
 /* Representation of zone */
@@ -71,132 +78,397 @@ static inline int find_zone(zone_t *zones, int zone_count, int x, int y) {
     return -1;
 }
 
-/* Read in graph file and build graph data structure */
+/*
+  Assign file zones to zones in contiguous blocks, as evenly as possible.
+  When the number of file zones is a multiple of the number of zones,
+  each block has the same number of file zones
+ */
+bool assign_zones(graph_t *g) {
+    int nid;
+    /* See if two zone counts are compatible */
+    if (g->nfzone < g->nzone) {
+	outmsg("ERROR.  Number of zones (%d) must be at most number in files (%d)",
+	       g->nzone, g->nfzone);
+	return false;
+    }
+    for (nid = 0; nid < g->nnode; nid++)
+	g->zone_id[nid] = (int) ((int64_t) g->fzone_id[nid] * g->nzone / g->nfzone);
+    return true;
+}
+
+/*
+  When graph file gives fewer zones than needed (including graphs
+  without zones, which have one), replace them by dividing the graph
+  with the partitioner
+ */
+static void partition_zones(graph_t *g) {
+    if (g->nfzone >= g->nzone)
+	return;
+    int cut = partition_graph(g, g->nzone, g->fzone_id);
+    g->nfzone = g->nzone;
+    outmsg("Partitioned graph into %d zones, cutting %d of %d edges\n", g->nzone, cut, g->nedge / 2);
+}
+
+/*
+  Estimate cost of simulating each file zone, given the nodes in list
+  (all nodes when list is NULL) and the positions of the rats on them.
+  Adds to cost, which has one entry per file zone
+ */
+void fzone_cost(graph_t *g, int *list, int nlist, int *position, int nrat, int64_t *cost) {
+    int i;
+    for (i = 0; i < nlist; i++) {
+	int nid = list == NULL ? i : list[i];
+	int degree = g->neighbor_start[nid+1] - g->neighbor_start[nid];
+	cost[g->fzone_id[nid]] += COST_NODE + COST_EDGE * degree;
+    }
+    for (i = 0; i < nrat; i++)
+	cost[g->fzone_id[position[i]]] += COST_RAT;
+}
+
+/* Largest cost of any zone relative to the average */
+static double zone_imbalance(int64_t *load, int nzone) {
+    int64_t total = 0;
+    int64_t max = 0;
+    int z;
+    for (z = 0; z < nzone; z++) {
+	total += load[z];
+	if (load[z] > max)
+	    max = load[z];
+    }
+    return total == 0 ? 1.0 : (double) max * nzone / total;
+}
+
+/*
+  Assign file zones to zones, balancing estimated costs: taking file
+  zones in order of decreasing cost, each goes to the zone with the
+  least cost so far.  Deterministic, so that all processes computing
+  it with the same costs get the same assignment.
+  Sets *changed when the assignment differs from the current one.
+ */
+bool balance_zones(graph_t *g, int64_t *cost, bool verbose, bool *changed) {
+    int nzone = g->nzone;
+    int nfzone = g->nfzone;
+    int nid, fz, z;
+    if (nfzone < nzone) {
+	outmsg("ERROR.  Number of zones (%d) must be at most number in files (%d)", nzone, nfzone);
+	return false;
+    }
+    int old_zone[nfzone];
+    int new_zone[nfzone];
+    int64_t old_load[nzone];
+    int64_t new_load[nzone];
+    int64_t key[nfzone];
+    for (nid = 0; nid < g->nnode; nid++)
+	old_zone[g->fzone_id[nid]] = g->zone_id[nid];
+    /* Sort by cost, with ties going to lower-numbered file zone */
+    for (fz = 0; fz < nfzone; fz++)
+	key[fz] = cost[fz] * nfzone + (nfzone - 1 - fz);
+    qsort(key, nfzone, sizeof(int64_t), comp_int64);
+    memset(old_load, 0, nzone * sizeof(int64_t));
+    memset(new_load, 0, nzone * sizeof(int64_t));
+    for (fz = 0; fz < nfzone; fz++)
+	old_load[old_zone[fz]] += cost[fz];
+    int i;
+    for (i = nfzone-1; i >= 0; i--) {
+	fz = nfzone - 1 - (int) (key[i] % nfzone);
+	int best = 0;
+	for (z = 1; z < nzone; z++)
+	    if (new_load[z] < new_load[best])
+		best = z;
+	new_zone[fz] = best;
+	new_load[best] += cost[fz];
+    }
+    *changed = memcmp(old_zone, new_zone, nfzone * sizeof(int)) != 0;
+    if (*changed) {
+	for (nid = 0; nid < g->nnode; nid++)
+	    g->zone_id[nid] = new_zone[g->fzone_id[nid]];
+    }
+    if (verbose)
+	outmsg("Zone loads: max/mean = %.3f (was %.3f)\n",
+	       zone_imbalance(new_load, nzone), zone_imbalance(old_load, nzone));
+    return true;
+}
+
+/*
+  Load graph from binary file.  Arrays are mapped directly from the file,
+  except for the zone ids, which depend on the number of zones
+ */
+static graph_t *map_graph(FILE *infile, int nzone) {
+    size_t length;
+    char *base = map_file(infile, &length);
+    fclose(infile);
+    if (base == NULL)
+	return NULL;
+    if (length < sizeof(graph_header_t)) {
+	outmsg("ERROR.  Binary graph file has invalid size\n");
+	munmap(base, length);
+	return NULL;
+    }
+    graph_header_t *header = (graph_header_t *) base;
+    int nnode = header->nnode;
+    int nedge = header->nedge;
+    int fnzone = header->nzone;
+    size_t expected = sizeof(graph_header_t) +
+	((size_t) (nnode + 1) + (size_t) (nnode + nedge) + (size_t) nnode) * sizeof(int32_t);
+    if (nnode <= 0 || nedge < 0 || length != expected) {
+	outmsg("ERROR.  Binary graph file has invalid size\n");
+	munmap(base, length);
+	return NULL;
+    }
+    graph_t *g = malloc(sizeof(graph_t));
+    if (g == NULL) {
+	munmap(base, length);
+	return NULL;
+    }
+    g->nnode = nnode;
+    g->nedge = nedge;
+    g->nzone = nzone;
+    g->nfzone = fnzone;
+    g->map_base = base;
+    g->map_length = length;
+    g->file_nid = NULL;
+    g->graph_nid = NULL;
+    g->global_nid = NULL;
+    g->global_nnode = nnode;
+    g->neighbor_start = (int *) (base + sizeof(graph_header_t));
+    g->neighbor = g->neighbor_start + nnode + 1;
+    g->fzone_id = g->neighbor + nnode + nedge;
+    g->zone_id = calloc(nnode, sizeof(int));
+    if (g->zone_id == NULL) {
+	outmsg("Couldn't allocate graph data structures");
+	free_graph(g);
+	return NULL;
+    }
+    /* Check validity of arrays */
+    int nid, eid;
+    bool ok = g->neighbor_start[0] == 0 && g->neighbor_start[nnode] == nnode + nedge;
+    for (nid = 0; ok && nid < nnode; nid++) {
+	ok = g->neighbor_start[nid] < g->neighbor_start[nid+1] &&
+	    g->neighbor[g->neighbor_start[nid]] == nid &&
+	    g->fzone_id[nid] >= 0 && g->fzone_id[nid] < fnzone;
+    }
+    for (eid = 0; ok && eid < nnode + nedge; eid++)
+	ok = g->neighbor[eid] >= 0 && g->neighbor[eid] < nnode;
+    if (!ok) {
+	outmsg("ERROR.  Binary graph file contains invalid data\n");
+	free_graph(g);
+	return NULL;
+    }
+    partition_zones(g);
+    if (!assign_zones(g)) {
+	free_graph(g);
+	return NULL;
+    }
+    outmsg("Loaded binary graph with %d nodes and %d edges (%d zones)\n", nnode, nedge, nzone);
+    return g;
+}
+
+/* Store graph in binary format */
+bool write_graph_binary(graph_t *g, FILE *outfile) {
+    graph_header_t header;
+    memcpy(header.magic, GRAPH_MAGIC, sizeof(header.magic));
+    header.nnode = g->nnode;
+    header.nedge = g->nedge;
+    header.nzone = g->nfzone;
+    bool ok = fwrite(&header, sizeof(header), 1, outfile) == 1;
+    ok = ok && fwrite(g->neighbor_start, sizeof(int), g->nnode+1, outfile) == g->nnode+1;
+    ok = ok && fwrite(g->neighbor, sizeof(int), g->nnode+g->nedge, outfile) == g->nnode+g->nedge;
+    ok = ok && fwrite(g->fzone_id, sizeof(int), g->nnode, outfile) == g->nnode;
+    if (!ok)
+	outmsg("ERROR.  Couldn't write binary graph file\n");
+    return ok;
+}
+
+/*
+  Parse records in chunk c of text graph file.
+  Edge i with head h goes at position i+h+1 of the adjacency lists,
+  following the self edges of nodes 0..h, and so chunks can be parsed
+  independently.  Starting points for nodes whose first edge begins the
+  chunk are filled in once all chunks are parsed.
+ */
+static void parse_graph_chunk(text_t *t, int c, graph_t *g, zone_t *zone_list, int fnzone,
+			      int *first_head, int *last_head, int *first_edge) {
+    int nnode = g->nnode;
+    int nedge = g->nedge;
+    int nrecord = nnode + nedge + (g->nzone > 0 ? fnzone : 0);
+    char *pos;
+    char *end = t->chunk_start[c+1];
+    int r = t->chunk_record[c];
+    int lineno = t->chunk_line[c];
+    int nid = -1;
+    first_head[c] = -1;
+    for (pos = t->chunk_start[c]; pos < end && r < nrecord; pos = next_line(pos), lineno++) {
+	if (!is_record(pos))
+	    continue;
+	if (r < nnode) {
+	    double ilf;
+	    if (scan_double(scan_char(pos, 'n'), &ilf) == NULL) {
+		snprintf(text_error(t, c), MAXLINE,
+			 "Line #%d of graph file malformed.  Expecting node %d", lineno, r+1);
+		return;
+	    }
+#if STATIC_ILF
+	    g->ilf[r] = ilf;
+#endif
+	} else if (r < nnode + nedge) {
+	    int i = r - nnode;
+	    int hid, tid;
+	    if (scan_int(scan_int(scan_char(pos, 'e'), &hid), &tid) == NULL) {
+		snprintf(text_error(t, c), MAXLINE,
+			 "Line #%d of graph file malformed.  Expecting edge %d", lineno, i+1);
+		return;
+	    }
+	    if (hid < 0 || hid >= nnode) {
+		snprintf(text_error(t, c), MAXLINE, "Invalid head index %d on line %d", hid, lineno);
+		return;
+	    }
+	    if (tid < 0 || tid >= nnode) {
+		snprintf(text_error(t, c), MAXLINE, "Invalid tail index %d on line %d", tid, lineno);
+		return;
+	    }
+	    if (first_head[c] < 0) {
+		first_head[c] = hid;
+		first_edge[c] = i;
+		nid = hid;
+	    }
+	    if (hid < nid) {
+		snprintf(text_error(t, c), MAXLINE, "Head index %d on line %d out of order", hid, lineno);
+		return;
+	    }
+	    // Starting edges for new node(s)
+	    while (nid < hid) {
+		nid++;
+		g->neighbor_start[nid] = i + nid;
+		// Self edge
+		g->neighbor[i + nid] = nid;
+	    }
+	    g->neighbor[i + hid + 1] = tid;
+	    last_head[c] = hid;
+	} else {
+	    int z = r - nnode - nedge;
+	    int x, y, w, h;
+	    if (scan_int(scan_int(scan_int(scan_int(scan_char(pos, 'z'), &x), &y), &w), &h) == NULL) {
+		snprintf(text_error(t, c), MAXLINE,
+			 "Line #%d of graph file malformed.  Expecting zone %d.", lineno, z+1);
+		return;
+	    }
+	    zone_list[z].x = x; zone_list[z].y = y; zone_list[z].w = w; zone_list[z].h = h;
+	}
+	r++;
+    }
+}
+
+/* Read in graph file and build graph data structure.  Text files are parsed in parallel */
 graph_t *read_graph(FILE *infile, int nzone) {
-    char linebuf[MAXLINE];
+    if (binary_file(infile, GRAPH_MAGIC))
+	return map_graph(infile, nzone);
+
+    text_t t;
     int nnode, nedge;
-    int i, hid, tid;
-    double ilf;
-    int nid, eid;
-    int lineno = 0;
-    // How many zones does the file have?
+    int nid, c;
+    // How many zones does the file have?  Without any, whole graph is one zone
     int fnzone = 1;
 
+    bool ok = read_text(infile, &t);
+    fclose(infile);
+    if (!ok)
+	return NULL;
     // Read header information
-    while (fgets(linebuf, MAXLINE, infile) != NULL) {
-	lineno++;
-	if (!is_comment(linebuf))
-	    break;
-    }
-    if (sscanf(linebuf, "%d %d  %d", &nnode, &nedge, &fnzone) < 2) {
+    int nfield = sscanf(t.header, "%d %d  %d", &nnode, &nedge, &fnzone);
+    if (nfield < 2 || nnode <= 0 || nedge < 0 || fnzone < 0) {
 	outmsg("ERROR. Malformed graph file header (line 1)\n");
+	free_text(&t);
 	return NULL;
     }
-
-    /* See if two zone counts are compatible */
-    if (fnzone % nzone != 0) {
-	outmsg("ERROR.  Number of zones (%d) must be multiple of number in files (%d)",
-	       nzone, fnzone);
+    int zone_lines = nfield == 3 ? fnzone : 0;
+    if (zone_lines == 0)
+	fnzone = 1;
+    int nrecord = nnode + nedge + (nzone > 0 ? zone_lines : 0);
+    if (t.chunk_record[t.nchunk] < nrecord) {
+	outmsg("ERROR.  Graph file has %d node, edge, and zone lines.  Expecting %d\n",
+	       t.chunk_record[t.nchunk], nrecord);
+	free_text(&t);
+	return NULL;
     }
-    int fzone_per_zone = fnzone / nzone;
 
     graph_t *g = new_graph(nnode, nedge, nzone);
-    if (g == NULL)
-	return g;
+    zone_t *zone_list = calloc(zone_lines > 0 ? zone_lines : 1, sizeof(zone_t));
+    int *first_head = int_alloc(t.nchunk);
+    int *last_head = int_alloc(t.nchunk);
+    int *first_edge = int_alloc(t.nchunk);
+    if (g == NULL || zone_list == NULL || first_head == NULL || last_head == NULL || first_edge == NULL) {
+	outmsg("Couldn't allocate graph data structures");
+	free_text(&t);
+	return NULL;
+    }
 
+#pragma omp parallel for schedule(dynamic)
+    for (c = 0; c < t.nchunk; c++)
+	parse_graph_chunk(&t, c, g, zone_list, zone_lines, first_head, last_head, first_edge);
+    ok = text_ok(&t);
+
+    /* Stitch chunks: check ordering across them, and start nodes whose first edge begins a chunk */
     nid = -1;
-    // We're going to add self edges, so eid will keep track of all edges.
-    eid = 0;
-    for (i = 0; i < nnode; i++) {
-	while (fgets(linebuf, MAXLINE, infile) != NULL) {
-	    lineno++;
-	    if (!is_comment(linebuf))
-		break;
-	}
-	if (sscanf(linebuf, "n %lf", &ilf) != 1) {
-	    outmsg("Line #%d of graph file malformed.  Expecting node %d\n", lineno, i+1);
-	}
-#if STATIC_ILF                        
-	g->ilf[i] = ilf;
-#endif
-    }
-    for (i = 0; i < nedge; i++) {
-	while (fgets(linebuf, MAXLINE, infile) != NULL) {
-	    lineno++;
-	    if (!is_comment(linebuf))
-		break;
-	}
-	if (sscanf(linebuf, "e %d %d", &hid, &tid) != 2) {
-	    outmsg("Line #%d of graph file malformed.  Expecting edge %d\n", lineno, i+1);
-	    return false;
+    for (c = 0; ok && c < t.nchunk; c++) {
+	if (first_head[c] < 0)
+	    continue;
+	if (first_head[c] < nid) {
+	    outmsg("Head index %d of edge %d out of order\n", first_head[c], first_edge[c]+1);
+	    ok = false;
 	}
-	if (hid < 0 || hid >= nnode) {
-	    outmsg("Invalid head index %d on line %d\n", hid, lineno);
-	    return false;
-	}
-	if (tid < 0 || tid >= nnode) {
-	    outmsg("Invalid tail index %d on line %d\n", tid, lineno);
-	    return false;
-	}
-	if (hid < nid) {
-	    outmsg("Head index %d on line %d out of order\n", hid, lineno);
-	    return false;
-	    
-	}
-	// Starting edges for new node(s)
-	while (nid < hid) {
+	while (nid < first_head[c]) {
 	    nid++;
-	    g->neighbor_start[nid] = eid;
-	    // Self edge
-	    g->neighbor[eid++] = nid;
+	    g->neighbor_start[nid] = first_edge[c] + nid;
+	    g->neighbor[first_edge[c] + nid] = nid;
 	}
-	g->neighbor[eid++] = tid;
+	nid = last_head[c];
+    }
+    free_text(&t);
+    free(first_head);
+    free(last_head);
+    free(first_edge);
+    if (!ok) {
+	free(zone_list);
+	free_graph(g);
+	return NULL;
     }
     while (nid < nnode-1) {
 	// Fill out any isolated nodes
 	nid++;
-	g->neighbor[eid++] = nid;
+	g->neighbor_start[nid] = nedge + nid;
+	g->neighbor[nedge + nid] = nid;
     }
-    g->neighbor_start[nnode] = eid;
+    g->neighbor_start[nnode] = nnode + nedge;
     
     if (nzone == 0) {
+	free(zone_list);
 	outmsg("Loaded graph with %d nodes and %d edges\n", nnode, nedge);
     } else {
-	/* Space for zone information */
-	zone_t zone_list[fnzone];
-
-	for (i = 0; i < fnzone; i++) {
-	    while (fgets(linebuf, MAXLINE, infile) != NULL) {
-		lineno++;
-		if (!is_comment(linebuf))
-		    break;
-	    }
-	    int x, y, w, h;
-	    if (sscanf(linebuf, "z %d %d %d %d", &x, &y, &w, &h) != 4) {
-		outmsg("Line #%d of graph file malformed.  Expecting zone %d.\n", lineno, i+1);
-	    }
-	    zone_list[i].x = x; zone_list[i].y = y; zone_list[i].w = w; zone_list[i].h = h;
+	g->nfzone = fnzone;
+	g->fzone_id = calloc(nnode, sizeof(int));
+	if (g->fzone_id == NULL) {
+	    outmsg("Couldn't allocate graph data structures");
+	    return NULL;
 	}
-	fclose(infile);
-	/* locate nodes within zones */
+	/* locate nodes within zones, which are rectangles in the k x k grid */
 	int ncol = (int) sqrt(nnode);
-	for (nid = 0; nid < nnode; nid++) {
+	int nlocate = zone_lines > 0 ? nnode : 0;
+#pragma omp parallel for schedule(static) if (nlocate >= PARALLEL_THRESHOLD)
+	for (nid = 0; nid < nlocate; nid++) {
 	    int x = nid % ncol;
 	    int y = nid / ncol;
 	    int zid = find_zone(zone_list, fnzone, x, y);
 	    if (zid < 0) {
 		outmsg("Error.  Could not find zone for node %d.  x = %d, y = %d", nid, x, y);
 	    }
-	    g->zone_id[nid] = zid / fzone_per_zone;
-	    //	    outmsg("Putting node %d in graph zone %d", nid, g->zone_id[nid]);
+	    g->fzone_id[nid] = zid;
 	}
+	free(zone_list);
+	partition_zones(g);
+	if (!assign_zones(g))
+	    return NULL;
 	outmsg("Loaded graph with %d nodes and %d edges (%d zones)\n", nnode, nedge, nzone);
     }
-
-
-    //#if DEBUG
-//    show_graph(g);
-//#endif
     return g;
 }
 
@@ -215,6 +487,221 @@ void show_graph(graph_t *g) {
 }
 #endif
 
+/*
+  Node renumbering.
+  Renumbered graph keeps each adjacency list in the same order (with
+  the self edge first), and so simulation results are identical once
+  node numbers are mapped back to those in the file.
+ */
+
+
+static inline int degree(graph_t *g, int nid) {
+    return g->neighbor_start[nid+1] - g->neighbor_start[nid];
+}
+
+/*
+  Reverse Cuthill-McKee ordering.  Breadth-first search from a node of
+  minimum degree, visiting neighbors in order of increasing degree.
+  Fills in order with list of nodes
+ */
+static bool rcm_order(graph_t *g, int *order) {
+    int nnode = g->nnode;
+    int64_t nn = nnode;
+    int maxdegree = 0;
+    int nid, eid, i;
+    for (nid = 0; nid < nnode; nid++)
+	if (degree(g, nid) > maxdegree)
+	    maxdegree = degree(g, nid);
+    /* Sort keys encode (degree, node) */
+    int64_t *by_degree = calloc(nnode, sizeof(int64_t));
+    int64_t *key = calloc(maxdegree, sizeof(int64_t));
+    bool *visited = bool_alloc(nnode);
+    if (by_degree == NULL || key == NULL || visited == NULL) {
+	free(by_degree);
+	free(key);
+	free(visited);
+	return false;
+    }
+    for (nid = 0; nid < nnode; nid++)
+	by_degree[nid] = degree(g, nid) * nn + nid;
+    qsort(by_degree, nnode, sizeof(int64_t), comp_int64);
+    int tail = 0;
+    int next_start = 0;
+    while (tail < nnode) {
+	/* Start new component from unvisited node of minimum degree */
+	while (visited[by_degree[next_start] % nn])
+	    next_start++;
+	int start = by_degree[next_start] % nn;
+	visited[start] = true;
+	order[tail++] = start;
+	int head = tail - 1;
+	while (head < tail) {
+	    nid = order[head++];
+	    int nkey = 0;
+	    for (eid = g->neighbor_start[nid]; eid < g->neighbor_start[nid+1]; eid++) {
+		int nbrnid = g->neighbor[eid];
+		if (!visited[nbrnid]) {
+		    visited[nbrnid] = true;
+		    key[nkey++] = degree(g, nbrnid) * nn + nbrnid;
+		}
+	    }
+	    qsort(key, nkey, sizeof(int64_t), comp_int64);
+	    for (i = 0; i < nkey; i++)
+		order[tail++] = key[i] % nn;
+	}
+    }
+    /* Reverse */
+    for (i = 0; i < nnode/2; i++) {
+	int t = order[i];
+	order[i] = order[nnode-1-i];
+	order[nnode-1-i] = t;
+    }
+    free(by_degree);
+    free(key);
+    free(visited);
+    return true;
+}
+
+/* Stable sort of node list by zone, so that each zone gets a contiguous block of numbers */
+static bool zone_blocked(graph_t *g, int *order) {
+    int nnode = g->nnode;
+    int nzone = g->nzone;
+    int *start = int_alloc(nzone + 1);
+    int *sorted = int_alloc(nnode);
+    int i, z;
+    if (start == NULL || sorted == NULL) {
+	free(start);
+	free(sorted);
+	return false;
+    }
+    for (i = 0; i < nnode; i++)
+	start[g->zone_id[order[i]]+1]++;
+    for (z = 0; z < nzone; z++)
+	start[z+1] += start[z];
+    for (i = 0; i < nnode; i++)
+	sorted[start[g->zone_id[order[i]]]++] = order[i];
+    memcpy(order, sorted, nnode * sizeof(int));
+    free(start);
+    free(sorted);
+    return true;
+}
+
+/*
+  Zone-major ordering: nodes ordered by file zone, and within each
+  file zone, in file order.  File zones are rectangular tiles of the
+  grid, and so neighboring nodes get nearby numbers
+ */
+static bool tile_order(graph_t *g, int *order) {
+    int nnode = g->nnode;
+    int64_t nn = nnode;
+    int nid;
+    if (g->nfzone == 0) {
+	for (nid = 0; nid < nnode; nid++)
+	    order[nid] = nid;
+	return true;
+    }
+    int64_t *key = calloc(nnode, sizeof(int64_t));
+    if (key == NULL)
+	return false;
+    for (nid = 0; nid < nnode; nid++)
+	key[nid] = g->fzone_id[nid] * nn + nid;
+    qsort(key, nnode, sizeof(int64_t), comp_int64);
+    for (nid = 0; nid < nnode; nid++)
+	order[nid] = key[nid] % nn;
+    free(key);
+    return true;
+}
+
+/*
+  Renumber nodes so that node i is node order[i] of the current graph.
+  Adjacency lists keep their order.
+ */
+static bool permute_graph(graph_t *g, int *order) {
+    int nnode = g->nnode;
+    int nedge = g->nedge;
+    int nid, eid;
+    int *graph_nid = int_alloc(nnode);
+    int *neighbor_start = int_alloc(nnode + 1);
+    int *neighbor = int_alloc(nnode + nedge);
+    int *zone_id = g->zone_id == NULL ? NULL : int_alloc(nnode);
+    int *fzone_id = g->fzone_id == NULL ? NULL : int_alloc(nnode);
+    if (graph_nid == NULL || neighbor_start == NULL || neighbor == NULL ||
+	(g->zone_id != NULL && zone_id == NULL) || (g->fzone_id != NULL && fzone_id == NULL)) {
+	free(graph_nid);
+	free(neighbor_start);
+	free(neighbor);
+	free(zone_id);
+	free(fzone_id);
+	return false;
+    }
+    for (nid = 0; nid < nnode; nid++)
+	graph_nid[order[nid]] = nid;
+    int pos = 0;
+    for (nid = 0; nid < nnode; nid++) {
+	int onid = order[nid];
+	neighbor_start[nid] = pos;
+	for (eid = g->neighbor_start[onid]; eid < g->neighbor_start[onid+1]; eid++)
+	    neighbor[pos++] = graph_nid[g->neighbor[eid]];
+	if (zone_id != NULL)
+	    zone_id[nid] = g->zone_id[onid];
+	if (fzone_id != NULL)
+	    fzone_id[nid] = g->fzone_id[onid];
+    }
+    neighbor_start[nnode] = pos;
+    /* Mappings compose with any earlier renumbering */
+    int *file_nid = int_alloc(nnode);
+    if (file_nid == NULL) {
+	free(graph_nid);
+	free(neighbor_start);
+	free(neighbor);
+	free(zone_id);
+	free(fzone_id);
+	return false;
+    }
+    for (nid = 0; nid < nnode; nid++)
+	file_nid[nid] = file_node(g, order[nid]);
+    for (nid = 0; nid < nnode; nid++)
+	graph_nid[file_nid[nid]] = nid;
+    if (g->map_base != NULL) {
+	munmap(g->map_base, g->map_length);
+	g->map_base = NULL;
+	g->map_length = 0;
+    } else {
+	free(g->neighbor);
+	free(g->neighbor_start);
+	free(g->fzone_id);
+    }
+    free(g->zone_id);
+    free(g->file_nid);
+    free(g->graph_nid);
+    g->neighbor = neighbor;
+    g->neighbor_start = neighbor_start;
+    g->zone_id = zone_id;
+    g->fzone_id = fzone_id;
+    g->file_nid = file_nid;
+    g->graph_nid = graph_nid;
+    return true;
+}
+
+bool reorder_graph(graph_t *g, reorder_t mode) {
+    if (mode == REORDER_NONE)
+	return true;
+    int *order = int_alloc(g->nnode);
+    bool ok = order != NULL;
+    if (ok && mode == REORDER_RCM) {
+	ok = rcm_order(g, order);
+	/* Keep zones contiguous for multiple processes */
+	if (ok && g->nzone > 1)
+	    ok = zone_blocked(g, order);
+    } else if (ok)
+	ok = tile_order(g, order);
+    ok = ok && permute_graph(g, order);
+    free(order);
+    if (!ok)
+	outmsg("Couldn't allocate space to renumber graph nodes\n");
+    return ok;
+}
+
 #if MPI
 /** MPI routines **/
 void send_graph(graph_t *g) {
@@ -222,16 +709,22 @@ void send_graph(graph_t *g) {
     int nnode = g->nnode;
     int nedge = g->nedge;
     int nzone = g->nzone;
-    int params[3] = {nnode, nedge, nzone};
-    MPI_Bcast(params, 3, MPI_INT, 0, MPI_COMM_WORLD);
+    int params[5] = {nnode, nedge, nzone, g->nfzone, g->file_nid != NULL};
+    MPI_Bcast(params, 5, MPI_INT, 0, MPI_COMM_WORLD);
     MPI_Bcast(g->neighbor, nedge+nnode, MPI_INT, 0, MPI_COMM_WORLD);
     MPI_Bcast(g->neighbor_start, nnode+1, MPI_INT, 0, MPI_COMM_WORLD);
     MPI_Bcast(g->zone_id, nnode, MPI_INT, 0, MPI_COMM_WORLD);
+    /* File zones are needed for per-zone load statistics */
+    if (g->nfzone > 0)
+	MPI_Bcast(g->fzone_id, nnode, MPI_INT, 0, MPI_COMM_WORLD);
+    /* Node numbering in file is needed for writing checkpoints */
+    if (g->file_nid != NULL)
+	MPI_Bcast(g->file_nid, nnode, MPI_INT, 0, MPI_COMM_WORLD);
 }
 
 graph_t *get_graph() {
-    int params[3];
-    MPI_Bcast(params, 3, MPI_INT, 0, MPI_COMM_WORLD);
+    int params[5];
+    MPI_Bcast(params, 5, MPI_INT, 0, MPI_COMM_WORLD);
     int nnode = params[0];
     int nedge = params[1];
     int nzone = params[2];
@@ -241,6 +734,206 @@ graph_t *get_graph() {
     MPI_Bcast(g->neighbor, nedge+nnode, MPI_INT, 0, MPI_COMM_WORLD);
     MPI_Bcast(g->neighbor_start, nnode+1, MPI_INT, 0, MPI_COMM_WORLD);
     MPI_Bcast(g->zone_id, nnode, MPI_INT, 0, MPI_COMM_WORLD);
+    g->nfzone = params[3];
+    if (g->nfzone > 0) {
+	g->fzone_id = int_alloc(nnode);
+	if (g->fzone_id == NULL) {
+	    outmsg("Couldn't allocate graph data structures");
+	    return NULL;
+	}
+	MPI_Bcast(g->fzone_id, nnode, MPI_INT, 0, MPI_COMM_WORLD);
+    }
+    if (params[4]) {
+	g->file_nid = int_alloc(nnode);
+	g->graph_nid = int_alloc(nnode);
+	if (g->file_nid == NULL || g->graph_nid == NULL) {
+	    outmsg("Couldn't allocate graph data structures");
+	    return NULL;
+	}
+	MPI_Bcast(g->file_nid, nnode, MPI_INT, 0, MPI_COMM_WORLD);
+	int nid;
+	for (nid = 0; nid < nnode; nid++)
+	    g->graph_nid[g->file_nid[nid]] = nid;
+    }
+    return g;
+}
+
+/* Message tag for sending subgraphs */
+#define TAG_SUBGRAPH 4
+
+/*
+  Build subgraph for zone z: its nodes plus a one-hop halo of their
+  neighbors in other zones, numbered in the same order as in g.  Zone
+  nodes keep their full adjacency lists.  Halo nodes list only their
+  self edge and their neighbors in the zone, which suffices for
+  propagating changes in their counts and weights.
+
+  Packed as message: parameters, followed by arrays of global node
+  numbers, adjacency list starts, adjacency lists, zone ids, file zone
+  ids, and node numbers in file.
+  Uses node_start and node_list (nodes of g ordered by zone), and
+  local_nid, which must have all entries -1 and is left that way.
+  Sets *lengthp to the message length
+ */
+static int *pack_subgraph(graph_t *g, int z, int *node_start, int *node_list, int *local_nid,
+			  int *lengthp) {
+    int i, eid;
+    /* Count zone nodes and their neighbors, with duplicates */
+    int ncandidate = 0;
+    for (i = node_start[z]; i < node_start[z+1]; i++)
+	ncandidate += degree(g, node_list[i]);
+    int *node = int_alloc(ncandidate > 0 ? ncandidate : 1);
+    if (node == NULL)
+	return NULL;
+    int nnode = 0;
+    for (i = node_start[z]; i < node_start[z+1]; i++) {
+	int nid = node_list[i];
+	for (eid = g->neighbor_start[nid]; eid < g->neighbor_start[nid+1]; eid++) {
+	    int nbrnid = g->neighbor[eid];
+	    if (local_nid[nbrnid] < 0) {
+		local_nid[nbrnid] = 0;
+		node[nnode++] = nbrnid;
+	    }
+	}
+    }
+    qsort(node, nnode, sizeof(int), comp_int);
+    int nentry = 0;
+    for (i = 0; i < nnode; i++) {
+	int nid = node[i];
+	local_nid[nid] = i;
+	if (g->zone_id[nid] == z) {
+	    nentry += degree(g, nid);
+	} else {
+	    nentry++;
+	    for (eid = g->neighbor_start[nid]+1; eid < g->neighbor_start[nid+1]; eid++)
+		nentry += g->zone_id[g->neighbor[eid]] == z;
+	}
+    }
+    int length = 5 + 5 * nnode + 1 + nentry;
+    int *msg = int_alloc(length);
+    if (msg == NULL) {
+	free(node);
+	return NULL;
+    }
+    msg[0] = nnode;
+    msg[1] = nentry - nnode;
+    msg[2] = g->nnode;
+    msg[3] = g->nzone;
+    msg[4] = g->nfzone;
+    int *global_nid = msg + 5;
+    int *neighbor_start = global_nid + nnode;
+    int *neighbor = neighbor_start + nnode + 1;
+    int *zone_id = neighbor + nentry;
+    int *fzone_id = zone_id + nnode;
+    int *file_nid = fzone_id + nnode;
+    int pos = 0;
+    for (i = 0; i < nnode; i++) {
+	int nid = node[i];
+	bool in_zone = g->zone_id[nid] == z;
+	global_nid[i] = nid;
+	neighbor_start[i] = pos;
+	for (eid = g->neighbor_start[nid]; eid < g->neighbor_start[nid+1]; eid++) {
+	    int nbrnid = g->neighbor[eid];
+	    if (in_zone || nbrnid == nid || g->zone_id[nbrnid] == z)
+		neighbor[pos++] = local_nid[nbrnid];
+	}
+	zone_id[i] = g->zone_id[nid];
+	fzone_id[i] = g->fzone_id == NULL ? 0 : g->fzone_id[nid];
+	file_nid[i] = file_node(g, nid);
+    }
+    neighbor_start[nnode] = pos;
+    for (i = 0; i < nnode; i++)
+	local_nid[node[i]] = -1;
+    free(node);
+    *lengthp = length;
+    return msg;
+}
+
+/*
+  Called by process 0 to send each other process the subgraph for its
+  zone, rather than the full graph.  Process 0 keeps the full graph
+ */
+void send_subgraphs(graph_t *g) {
+    int nnode = g->nnode;
+    int nzone = g->nzone;
+    int nid, z;
+    int *node_start = int_alloc(nzone + 1);
+    int *node_list = int_alloc(nnode);
+    int *local_nid = int_alloc(nnode);
+    if (node_start == NULL || node_list == NULL || local_nid == NULL) {
+	outmsg("Couldn't allocate space for subgraphs.  Exiting");
+	MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    /* Order nodes by zone */
+    for (nid = 0; nid < nnode; nid++)
+	node_start[g->zone_id[nid]+1]++;
+    for (z = 0; z < nzone; z++)
+	node_start[z+1] += node_start[z];
+    for (nid = 0; nid < nnode; nid++)
+	node_list[node_start[g->zone_id[nid]]++] = nid;
+    for (z = nzone; z > 0; z--)
+	node_start[z] = node_start[z-1];
+    node_start[0] = 0;
+    for (nid = 0; nid < nnode; nid++)
+	local_nid[nid] = -1;
+    for (z = 1; z < nzone; z++) {
+	int length = 0;
+	int *msg = pack_subgraph(g, z, node_start, node_list, local_nid, &length);
+	if (msg == NULL) {
+	    outmsg("Couldn't allocate space for subgraphs.  Exiting");
+	    MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	MPI_Send(msg, length, MPI_INT, z, TAG_SUBGRAPH, MPI_COMM_WORLD);
+	free(msg);
+    }
+    free(node_start);
+    free(node_list);
+    free(local_nid);
+}
+
+/* Called by other processes to receive the subgraph for their zone */
+graph_t *get_subgraph() {
+    MPI_Status status;
+    int length;
+    MPI_Probe(0, TAG_SUBGRAPH, MPI_COMM_WORLD, &status);
+    MPI_Get_count(&status, MPI_INT, &length);
+    int *msg = int_alloc(length);
+    if (msg == NULL) {
+	outmsg("Couldn't allocate graph data structures");
+	return NULL;
+    }
+    MPI_Recv(msg, length, MPI_INT, 0, TAG_SUBGRAPH, MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+    int nnode = msg[0];
+    int nedge = msg[1];
+    int nentry = nnode + nedge;
+    graph_t *g = new_graph(nnode, nedge, msg[3]);
+    if (g == NULL) {
+	free(msg);
+	return NULL;
+    }
+    g->global_nnode = msg[2];
+    g->nfzone = msg[4];
+    g->global_nid = int_alloc(nnode);
+    g->fzone_id = int_alloc(nnode);
+    g->file_nid = int_alloc(nnode);
+    if (g->global_nid == NULL || g->fzone_id == NULL || g->file_nid == NULL) {
+	outmsg("Couldn't allocate graph data structures");
+	free(msg);
+	return NULL;
+    }
+    int *pos = msg + 5;
+    memcpy(g->global_nid, pos, nnode * sizeof(int));
+    pos += nnode;
+    memcpy(g->neighbor_start, pos, (nnode + 1) * sizeof(int));
+    pos += nnode + 1;
+    memcpy(g->neighbor, pos, nentry * sizeof(int));
+    pos += nentry;
+    memcpy(g->zone_id, pos, nnode * sizeof(int));
+    pos += nnode;
+    memcpy(g->fzone_id, pos, nnode * sizeof(int));
+    pos += nnode;
+    memcpy(g->file_nid, pos, nnode * sizeof(int));
+    free(msg);
     return g;
 }
 #endif
@@ -303,12 +996,24 @@ bool setup_zone(graph_t *g, int this_zone) {
     g->this_zone = this_zone;
     int nzone = g->nzone;
     int nnode = g->nnode;
-    int maxzone = nnode/nzone;
-    int maxperimeter = 4*((int) sqrt(g->nnode));
     int lcount = 0;
-    int nid;
+    int nid, eid;
     int z;
-    g->local_node_list = calloc(maxzone, sizeof(int));
+    /* Zones can differ in size and shape.  Count nodes and boundary edges to size lists */
+    int *edge_count = int_alloc(nzone);
+    if (edge_count == NULL) {
+	outmsg("Couldn't allocate space for export/import info");
+	return false;
+    }
+    for (nid = 0; nid < nnode; nid++) {
+	if (g->zone_id[nid] != this_zone)
+	    continue;
+	lcount++;
+	for (eid = g->neighbor_start[nid]; eid < g->neighbor_start[nid+1]; eid++)
+	    if (g->zone_id[g->neighbor[eid]] != this_zone)
+		edge_count[g->zone_id[g->neighbor[eid]]]++;
+    }
+    g->local_node_list = int_alloc(lcount > 0 ? lcount : 1);
     if (g->local_node_list == NULL) {
 	outmsg("Couldn't allocate space for local nodes");
 	return false;
@@ -325,9 +1030,9 @@ bool setup_zone(graph_t *g, int this_zone) {
 	return false;
     }
     for (z = 0; z < nzone; z++) {
-	if (z != this_zone) {
-	    g->export_node_list[z] = calloc(maxperimeter, sizeof(int));
-	    g->import_node_list[z] = calloc(maxperimeter, sizeof(int));
+	if (edge_count[z] > 0) {
+	    g->export_node_list[z] = calloc(edge_count[z], sizeof(int));
+	    g->import_node_list[z] = calloc(edge_count[z], sizeof(int));
 	    if (g->export_node_list[z] == NULL ||
 		g->import_node_list[z] == NULL) {
 		outmsg("Couldn't allocate space for export/import info");
@@ -335,11 +1040,12 @@ bool setup_zone(graph_t *g, int this_zone) {
 	    }
 	}
     }
+    free(edge_count);
+    lcount = 0;
     for (nid = 0; nid < nnode; nid++) {
 	int zid = g->zone_id[nid];
 	if (zid == this_zone) {
 	    g->local_node_list[lcount++] = nid;
-	    int eid;
 	    for (eid = g->neighbor_start[nid]; eid < g->neighbor_start[nid+1]; eid++) {
 		int nbrnid = g->neighbor[eid];
 		int nbrzid = g->zone_id[nbrnid];
@@ -374,3 +1080,23 @@ bool setup_zone(graph_t *g, int this_zone) {
     }
     return true;
 }
+
+/* Release zone-specific data structures, so that they can be set up for a new assignment of zones */
+void clear_zone(graph_t *g) {
+    int z;
+    for (z = 0; z < g->nzone; z++) {
+	free(g->export_node_list[z]);
+	free(g->import_node_list[z]);
+    }
+    free(g->local_node_list);
+    free(g->export_node_count);
+    free(g->export_node_list);
+    free(g->import_node_count);
+    free(g->import_node_list);
+    g->local_node_list = NULL;
+    g->export_node_count = NULL;
+    g->export_node_list = NULL;
+    g->import_node_count = NULL;
+    g->import_node_list = NULL;
+    g->local_node_count = 0;
+}
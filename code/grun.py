@@ -6,6 +6,7 @@ import getopt
 import datetime
 import math
 import traceback
+import array
 
 import rutil
 import gengraph
@@ -163,15 +164,55 @@ class DrivenSimulator(VizSimulator):
     def ratCount(self):
         return self.nrats
 
+    # Read n binary integers from driver
+    def readInts(self, n):
+        data = sys.stdin.read(4 * n)
+        vals = array.array('i')
+        vals.fromstring(data)
+        if len(vals) != n:
+            raise Exception("Expected %d values.  Got %d" % (n, len(vals)))
+        return vals
+
+    # Load step given in binary form.  Either full set of counts ("BSTEP N R")
+    # or (node, count) pairs for nodes that changed since last step with counts ("DSTEP N R K")
+    def loadBinaryCounts(self, tokens):
+        try:
+            ncount, self.nrats = map(int, tokens[1:3])
+            if self.nodes == []:
+                self.nodes = [sim.Node(nid) for nid in xrange(ncount)]
+            if tokens[0] == "BSTEP":
+                counts = self.readInts(ncount)
+                for nid in xrange(ncount):
+                    self.nodes[nid].ratCount = counts[nid]
+            else:
+                nchange = int(tokens[3])
+                vals = self.readInts(2 * nchange)
+                for i in xrange(nchange):
+                    self.nodes[vals[2*i]].ratCount = vals[2*i+1]
+        except Exception as e:
+            self.errorMsg("Failed to receive binary input from driver: %s." % e)
+            return "ERROR"
+        line = sys.stdin.readline()
+        if line.strip() != "END":
+            self.errorMsg("Invalid driver input.  Expected 'END'.  Got '%s'" % line.strip())
+            return "ERROR"
+        return "OK"
+
     def loadCounts(self):
         id = -1
-        for line in sys.stdin:
+        while True:
+            # Use readline rather than iterating, since binary data may follow header
+            line = sys.stdin.readline()
+            if line == "":
+                break
             if line[-1] == '\n':
                 line = line[:-1]
             tokens = line.split()
             if id == -1:
                 if len(tokens) >= 1 and tokens[0] == "DONE":
                     return tokens[0]
+                if len(tokens) >= 3 and tokens[0] in ["BSTEP", "DSTEP"]:
+                    return self.loadBinaryCounts(tokens)
                 if len(tokens) < 1 or tokens[0] != "STEP":
                     self.errorMsg("Invalid driver input.  First line contents '%s'" % line)
                     return "ERROR"
@@ -180,11 +221,9 @@ class DrivenSimulator(VizSimulator):
                 except Exception as e:
                     self.errorMsg("Failed to receive parameter line from driver: %s.  Line contents '%s'" % (e, line))
                     return "ERROR"
+                # Counts carry over from previous step when none given, so that later DSTEP updates remain valid
                 if self.nodes == []:
                     self.nodes = [sim.Node(nid) for nid in xrange(ncount)]
-                else:
-                    for nid in xrange(ncount):
-                        self.nodes[nid].reset()
             elif len(tokens) == 1 and tokens[0] == "END":
                 break
             elif len(tokens) == 1:
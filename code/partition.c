@@ -0,0 +1,442 @@
+/*
+  Multilevel graph partitioner, for graphs whose files don't divide them into enough zones.
+  Divides the nodes into parts of nearly equal estimated cost, while
+  keeping the number of edges between parts (and hence the boundary
+  lists set up by setup_zone) small.
+
+  Parts are formed by recursive bisection.  Each bisection coarsens the
+  graph by repeatedly contracting a heavy-edge matching, splits the
+  coarsest graph by growing a region from a seed node, and then projects
+  the split back through the levels, refining it at each level by moving
+  boundary nodes between the halves.
+ */
+
+#include "crun.h"
+
+/* Weighted graph used while partitioning.  Adjacency lists exclude self edges */
+typedef struct {
+    int n;
+    // Adjacency list of node v is adj[start[v]] .. adj[start[v+1]-1].  Length = n+1
+    int *start;
+    int *adj;
+    // Weight of each edge: number of original edges it represents
+    int *ewgt;
+    // Weight of each node: estimated cost of original nodes it represents
+    int64_t *vwgt;
+    int64_t total;
+} pgraph_t;
+
+static void *palloc(size_t n, size_t size) {
+    void *p = calloc(n > 0 ? n : 1, size);
+    if (p == NULL) {
+	outmsg("Couldn't allocate space for partitioning graph.  Exiting");
+	exit(1);
+    }
+    return p;
+}
+
+static pgraph_t *new_pgraph(int n, int m) {
+    pgraph_t *g = palloc(1, sizeof(pgraph_t));
+    g->n = n;
+    g->start = palloc(n + 1, sizeof(int));
+    g->adj = palloc(m, sizeof(int));
+    g->ewgt = palloc(m, sizeof(int));
+    g->vwgt = palloc(n, sizeof(int64_t));
+    g->total = 0;
+    return g;
+}
+
+static void free_pgraph(pgraph_t *g) {
+    free(g->start);
+    free(g->adj);
+    free(g->ewgt);
+    free(g->vwgt);
+    free(g);
+}
+
+/* Random integer between 0 and n-1 */
+static inline int random_index(random_t *seed, int n) {
+    int i = (int) next_random_float(seed, (double) n);
+    return i < n ? i : n-1;
+}
+
+/*
+  Contract heavy-edge matching: visiting nodes in random order, match
+  each unmatched node with the unmatched neighbor sharing the heaviest
+  edge.  cmap gives coarse node for each node.
+ */
+static pgraph_t *coarsen(pgraph_t *g, int *cmap, random_t *seed) {
+    int n = g->n;
+    int i, v, e;
+    int *order = palloc(n, sizeof(int));
+    int *match = palloc(n, sizeof(int));
+    for (v = 0; v < n; v++) {
+	order[v] = v;
+	match[v] = -1;
+    }
+    for (i = n; i > 1; i--) {
+	int j = random_index(seed, i);
+	int t = order[j];
+	order[j] = order[i-1];
+	order[i-1] = t;
+    }
+    /* Keep coarse nodes small enough that coarsest graph can still be balanced */
+    int64_t max_weight = (int64_t) (1.5 * g->total / PARTITION_COARSEN) + 1;
+    int nc = 0;
+    int *first = order;
+    for (i = 0; i < n; i++) {
+	v = order[i];
+	if (match[v] >= 0)
+	    continue;
+	int best = v;
+	int best_weight = 0;
+	for (e = g->start[v]; e < g->start[v+1]; e++) {
+	    int u = g->adj[e];
+	    if (match[u] < 0 && u != v && g->ewgt[e] > best_weight &&
+		g->vwgt[v] + g->vwgt[u] <= max_weight) {
+		best = u;
+		best_weight = g->ewgt[e];
+	    }
+	}
+	match[v] = best;
+	match[best] = v;
+	cmap[v] = cmap[best] = nc;
+	/* Order no longer needed at positions before i, so reuse it to record first member */
+	first[nc++] = v;
+    }
+
+    /* Merge adjacency lists of matched pairs, combining edges to the same coarse node */
+    pgraph_t *cg = new_pgraph(nc, g->start[n]);
+    int *pos = palloc(nc, sizeof(int));
+    int c;
+    for (c = 0; c < nc; c++)
+	pos[c] = -1;
+    int m = 0;
+    for (c = 0; c < nc; c++) {
+	cg->start[c] = m;
+	int member[2] = { first[c], match[first[c]] };
+	int k;
+	for (k = 0; k < (member[0] == member[1] ? 1 : 2); k++) {
+	    v = member[k];
+	    cg->vwgt[c] += g->vwgt[v];
+	    for (e = g->start[v]; e < g->start[v+1]; e++) {
+		int cu = cmap[g->adj[e]];
+		if (cu == c)
+		    continue;
+		if (pos[cu] >= cg->start[c]) {
+		    cg->ewgt[pos[cu]] += g->ewgt[e];
+		} else {
+		    pos[cu] = m;
+		    cg->adj[m] = cu;
+		    cg->ewgt[m] = g->ewgt[e];
+		    m++;
+		}
+	    }
+	}
+    }
+    cg->start[nc] = m;
+    cg->total = g->total;
+    free(order);
+    free(match);
+    free(pos);
+    return cg;
+}
+
+/* Weights of edges from v to the other part (*ext) and to its own part (*in) */
+static inline void edge_split(pgraph_t *g, int *part, int v, int *ext, int *in) {
+    int e;
+    int x = 0;
+    int y = 0;
+    for (e = g->start[v]; e < g->start[v+1]; e++) {
+	if (part[g->adj[e]] == part[v])
+	    y += g->ewgt[e];
+	else
+	    x += g->ewgt[e];
+    }
+    *ext = x;
+    *in = y;
+}
+
+static int64_t cut_weight(pgraph_t *g, int *part) {
+    int64_t cut = 0;
+    int v;
+    for (v = 0; v < g->n; v++) {
+	int ext, in;
+	edge_split(g, part, v, &ext, &in);
+	cut += ext;
+    }
+    return cut / 2;
+}
+
+static inline int64_t abs64(int64_t x) {
+    return x < 0 ? -x : x;
+}
+
+/*
+  Improve bisection, where part 0 should have weight target +/- tol.
+  First restore balance by moving nodes from the heavier part, best gain
+  first.  Then make passes over the boundary nodes, moving those that
+  reduce the cut without upsetting the balance.
+ */
+static void refine(pgraph_t *g, int *part, int64_t target, int64_t tol) {
+    int n = g->n;
+    int v, i, pass;
+    int64_t w0 = 0;
+    int max_degree = 0;
+    for (v = 0; v < n; v++) {
+	if (part[v] == 0)
+	    w0 += g->vwgt[v];
+	int d = 0;
+	int e;
+	for (e = g->start[v]; e < g->start[v+1]; e++)
+	    d += g->ewgt[e];
+	if (d > max_degree)
+	    max_degree = d;
+    }
+    int64_t *key = palloc(n, sizeof(int64_t));
+    for (pass = 0; pass < PARTITION_PASSES && abs64(w0 - target) > tol; pass++) {
+	int from = w0 > target ? 0 : 1;
+	int ncand = 0;
+	for (v = 0; v < n; v++) {
+	    if (part[v] != from)
+		continue;
+	    int ext, in;
+	    edge_split(g, part, v, &ext, &in);
+	    key[ncand++] = (int64_t) (ext - in + max_degree) * n + v;
+	}
+	qsort(key, ncand, sizeof(int64_t), comp_int64);
+	for (i = ncand-1; i >= 0 && abs64(w0 - target) > tol; i--) {
+	    v = (int) (key[i] % n);
+	    int64_t nw0 = from == 0 ? w0 - g->vwgt[v] : w0 + g->vwgt[v];
+	    if (abs64(nw0 - target) < abs64(w0 - target)) {
+		part[v] = 1 - from;
+		w0 = nw0;
+	    }
+	}
+    }
+    free(key);
+    for (pass = 0; pass < PARTITION_PASSES; pass++) {
+	int moved = 0;
+	for (v = 0; v < n; v++) {
+	    int ext, in;
+	    edge_split(g, part, v, &ext, &in);
+	    if (ext == 0)
+		continue;
+	    int gain = ext - in;
+	    int64_t nw0 = part[v] == 0 ? w0 - g->vwgt[v] : w0 + g->vwgt[v];
+	    if ((gain > 0 && abs64(nw0 - target) <= tol) ||
+		(gain == 0 && abs64(nw0 - target) < abs64(w0 - target))) {
+		part[v] = 1 - part[v];
+		w0 = nw0;
+		moved++;
+	    }
+	}
+	if (moved == 0)
+	    break;
+    }
+}
+
+/* Allowed deviation from target weight of part 0 */
+static int64_t tolerance(pgraph_t *g) {
+    int64_t tol = (int64_t) (PARTITION_TOLERANCE * g->total);
+    int v;
+    for (v = 0; v < g->n; v++)
+	if (g->vwgt[v] > tol)
+	    tol = g->vwgt[v];
+    return tol;
+}
+
+/*
+  Split small graph by growing part 0 breadth-first from random seed
+  nodes, keeping the best of several refined attempts
+ */
+static void initial_bisect(pgraph_t *g, int64_t target, int *part, random_t *seed) {
+    int n = g->n;
+    int *queue = palloc(n, sizeof(int));
+    int *trial = palloc(n, sizeof(int));
+    int64_t tol = tolerance(g);
+    int64_t best_cut = -1;
+    int t, v, e;
+    for (t = 0; t < PARTITION_TRIES; t++) {
+	for (v = 0; v < n; v++)
+	    trial[v] = 1;
+	int64_t w0 = 0;
+	int head = 0;
+	int tail = 0;
+	int next = random_index(seed, n);
+	while (w0 < target) {
+	    if (head == tail) {
+		/* Start new region (graph may be disconnected) */
+		int k;
+		for (k = 0; k < n && trial[(next + k) % n] == 0; k++)
+		    ;
+		if (k == n)
+		    break;
+		v = (next + k) % n;
+		trial[v] = 0;
+		w0 += g->vwgt[v];
+		queue[tail++] = v;
+		continue;
+	    }
+	    v = queue[head++];
+	    for (e = g->start[v]; e < g->start[v+1] && w0 < target; e++) {
+		int u = g->adj[e];
+		if (trial[u] == 1) {
+		    trial[u] = 0;
+		    w0 += g->vwgt[u];
+		    queue[tail++] = u;
+		}
+	    }
+	}
+	refine(g, trial, target, tol);
+	int64_t cut = cut_weight(g, trial);
+	if (best_cut < 0 || cut < best_cut) {
+	    best_cut = cut;
+	    memcpy(part, trial, n * sizeof(int));
+	}
+    }
+    free(queue);
+    free(trial);
+}
+
+/* Split graph into parts 0 and 1, with part 0 having weight close to target */
+static void multilevel_bisect(pgraph_t *g, int64_t target, int *part, random_t *seed) {
+    pgraph_t *level[PARTITION_LEVELS];
+    int *cmap[PARTITION_LEVELS];
+    int nlevel = 0;
+    level[0] = g;
+    while (level[nlevel]->n > PARTITION_COARSEN && nlevel < PARTITION_LEVELS-1) {
+	pgraph_t *fg = level[nlevel];
+	int *cm = palloc(fg->n, sizeof(int));
+	pgraph_t *cg = coarsen(fg, cm, seed);
+	if (cg->n > 0.95 * fg->n) {
+	    /* Matching no longer shrinking graph */
+	    free_pgraph(cg);
+	    free(cm);
+	    break;
+	}
+	cmap[nlevel] = cm;
+	level[++nlevel] = cg;
+    }
+    int *cpart = nlevel == 0 ? part : palloc(level[nlevel]->n, sizeof(int));
+    initial_bisect(level[nlevel], target, cpart, seed);
+    int l, v;
+    for (l = nlevel-1; l >= 0; l--) {
+	pgraph_t *fg = level[l];
+	int *fpart = l == 0 ? part : palloc(fg->n, sizeof(int));
+	for (v = 0; v < fg->n; v++)
+	    fpart[v] = cpart[cmap[l][v]];
+	free(cpart);
+	free(cmap[l]);
+	free_pgraph(level[l+1]);
+	refine(fg, fpart, target, tolerance(fg));
+	cpart = fpart;
+    }
+}
+
+/* Subgraph induced by nodes in given part.  vmap gives original node for each of its nodes */
+static pgraph_t *subgraph(pgraph_t *g, int *part, int side, int *vmap, int **sub_vmap) {
+    int n = g->n;
+    int *id = palloc(n, sizeof(int));
+    int v, e;
+    int sn = 0;
+    int sm = 0;
+    for (v = 0; v < n; v++) {
+	id[v] = part[v] == side ? sn++ : -1;
+	if (part[v] == side)
+	    for (e = g->start[v]; e < g->start[v+1]; e++)
+		if (part[g->adj[e]] == side)
+		    sm++;
+    }
+    pgraph_t *sg = new_pgraph(sn, sm);
+    int *svmap = palloc(sn, sizeof(int));
+    int m = 0;
+    for (v = 0; v < n; v++) {
+	if (id[v] < 0)
+	    continue;
+	int sv = id[v];
+	svmap[sv] = vmap[v];
+	sg->start[sv] = m;
+	sg->vwgt[sv] = g->vwgt[v];
+	sg->total += g->vwgt[v];
+	for (e = g->start[v]; e < g->start[v+1]; e++) {
+	    int u = g->adj[e];
+	    if (id[u] >= 0) {
+		sg->adj[m] = id[u];
+		sg->ewgt[m] = g->ewgt[e];
+		m++;
+	    }
+	}
+    }
+    sg->start[sn] = m;
+    free(id);
+    *sub_vmap = svmap;
+    return sg;
+}
+
+/* Divide graph into nparts parts, numbered from first */
+static void partition_recursive(pgraph_t *g, int *vmap, int nparts, int first, int *result, random_t *seed) {
+    int v;
+    if (nparts == 1 || g->n <= 1) {
+	for (v = 0; v < g->n; v++)
+	    result[vmap[v]] = first;
+	return;
+    }
+    int nlow = nparts / 2;
+    int64_t target = g->total * nlow / nparts;
+    int *part = palloc(g->n, sizeof(int));
+    multilevel_bisect(g, target, part, seed);
+    int side;
+    for (side = 0; side < 2; side++) {
+	int *sub_vmap;
+	pgraph_t *sg = subgraph(g, part, side, vmap, &sub_vmap);
+	if (side == 0)
+	    partition_recursive(sg, sub_vmap, nlow, first, result, seed);
+	else
+	    partition_recursive(sg, sub_vmap, nparts - nlow, first + nlow, result, seed);
+	free_pgraph(sg);
+	free(sub_vmap);
+    }
+    free(part);
+}
+
+/*
+  Partition nodes of graph into nparts parts, storing part of each node.
+  Node weights are estimated costs of simulating the nodes, as used
+  for balancing zones.  Deterministic.  Returns number of (undirected) edges cut
+ */
+int partition_graph(graph_t *g, int nparts, int *part) {
+    int nnode = g->nnode;
+    int nid, eid;
+    pgraph_t *pg = new_pgraph(nnode, g->nedge);
+    int m = 0;
+    for (nid = 0; nid < nnode; nid++) {
+	pg->start[nid] = m;
+	int degree = g->neighbor_start[nid+1] - g->neighbor_start[nid];
+	pg->vwgt[nid] = COST_NODE + COST_EDGE * degree;
+	pg->total += pg->vwgt[nid];
+	for (eid = g->neighbor_start[nid]; eid < g->neighbor_start[nid+1]; eid++) {
+	    if (g->neighbor[eid] == nid)
+		continue;
+	    pg->adj[m] = g->neighbor[eid];
+	    pg->ewgt[m] = 1;
+	    m++;
+	}
+    }
+    pg->start[nnode] = m;
+    int *vmap = palloc(nnode, sizeof(int));
+    for (nid = 0; nid < nnode; nid++)
+	vmap[nid] = nid;
+    random_t seed;
+    random_t seed_list[1] = { DEFAULTSEED };
+    reseed(&seed, seed_list, 1);
+    partition_recursive(pg, vmap, nparts, 0, part, &seed);
+    int cut = 0;
+    for (nid = 0; nid < nnode; nid++)
+	for (eid = pg->start[nid]; eid < pg->start[nid+1]; eid++)
+	    if (part[pg->adj[eid]] != part[nid])
+		cut++;
+    free_pgraph(pg);
+    free(vmap);
+    return cut / 2;
+}
@@ -8,6 +8,7 @@ import math
 import os
 import os.path
 import getopt
+import glob
 
 def usage(fname):
     print "Usage: %s [-h] [-c] [-t THD] [-p PCS]" % fname
@@ -26,6 +27,8 @@ standardProg = "./grun.py"
 # Simulator being tested
 testProg = "./crun-seq"
 mpiTestProg = "./crun-mpi"
+# Converter to binary graph and rat files
+convertProg = "./gconvert"
 
 # Directories
 # graph and rat files
@@ -60,6 +63,11 @@ regressionList = [
     (36, 'h', 'd', 10, 4, 'b', 26),
     (36, 'v', 'd', 10, 4, 'b', 27),
     (36, 'p', 'u', 10, 6, 'b', 28),
+
+    (12, 't', 'r', 4, 10, 's', 31),
+    (12, 'p', 'u', 4, 10, 's', 32),
+    (12, 'h', 'd', 4, 10, 'r', 33),
+    (36, 'v', 'r', 10, 3, 'r', 34),
     ]
 
 # These are too large for the Python simulator.
@@ -69,6 +77,47 @@ extraRegressionList = [
     (180, 't', 'd', 32, 2, 'b', 30)
 ]
 
+# Variations in how the test simulator gets its result.  Each must
+# match the reference simulator's result for the same parameters.
+# Each defined by:
+#  Regression parameters (as above)
+#  Variant:
+#    'c': Write checkpoint partway through, then restart from it
+#    'g': Read binary graph and rat files, generated with gconvert
+#    'o': Run with extra command-line options
+#    'e': Run ensemble in single process.  Replica i must match the
+#         reference simulator's result for seed + i
+#    'z': Strip zones from graph file, so that simulator partitions graph
+#  Argument:
+#    'c': (Steps before checkpoint, processes before, processes after).
+#         Process counts are 'P' (as given by -p), 'P-1', or '1' (crun-seq)
+#    'g': None
+#    'o': List of options
+#    'e': Number of replicas
+#    'z': Whether to convert stripped graph to binary with gconvert
+variantRegressionList = [
+    ((12, 'h', 'u', 4, 10, 'b', 21), 'c', (4, 'P', 'P')),
+    ((12, 't', 'r', 4, 10, 's', 31), 'c', (5, 'P', 'P-1')),
+    ((12, 'h', 'd', 4, 10, 'r', 33), 'c', (3, 'P', '1')),
+    ((36, 'v', 'd', 10, 4, 'b', 27), 'c', (1, '1', 'P')),
+
+    ((12, 'v', 'd', 4, 11, 'b', 22), 'g', None),
+    ((36, 'h', 'd', 10, 4, 'b', 26), 'g', None),
+
+    ((12, 'p', 'r', 4, 12, 'b', 23), 'o', ['-O', 'r']),
+    ((36, 't', 'r', 10, 6, 'b', 25), 'o', ['-O', 'r']),
+    ((12, 'h', 'd', 4, 10, 'r', 33), 'o', ['-O', 'z']),
+    ((36, 'p', 'u', 10, 6, 'b', 28), 'o', ['-B', '0']),
+    ((36, 'v', 'r', 10, 3, 'r', 34), 'o', ['-B', '1']),
+    ((12, 't', 'r', 4, 10, 'b', 18), 'o', ['-l']),
+    ((12, 'p', 'u', 4, 10, 's', 32), 'o', ['-l']),
+
+    ((12, 't', 'u', 4, 12, 'b', 20), 'e', 2),
+
+    ((36, 'p', 'u', 10, 6, 'b', 28), 'z', False),
+    ((12, 't', 'd', 4, 11, 'b', 19), 'z', True),
+    ]
+
 def gname(k, tag):
     return "g-%s%.3dx%.3d.gph" % (tag, k, k)
 
@@ -82,12 +131,43 @@ def regressionName(params, standard = True, short = False):
         return name
     return ("ref" if standard else "tst") +  "-" + name
 
-def regressionCommand(params, standard = True, processCount = 1):    
-    graphDimension, graphType, ratType, ratLoad, stepCount, updateFlag, seed = params
+def variantName(params, variant, arg):
+    name = regressionName(params, standard = False)[:-4]
+    if variant == 'c':
+        name += "-c%d-%s-%s" % arg
+    elif variant == 'g':
+        name += "-g"
+    elif variant == 'e':
+        name += "-e%d" % arg
+    elif variant == 'z':
+        name += "-zg" if arg else "-z"
+    else:
+        name += "-o" + "".join([a.lstrip("-") for a in arg])
+    return name + ".txt"
+
+def variantProcessCount(code, processCount):
+    if code == '1':
+        return 1
+    elif code == 'P-1':
+        return max(processCount - 1, 1)
+    return processCount
 
-    graphFileName = dataDir + "/" + gname(graphDimension, graphType)
+# Optional arguments:
+#   graphFileName, ratFileName: Override files in data directory
+#   stepCount: Override step count in params
+#   extraArgs: Added to end of test command
+def regressionCommand(params, standard = True, processCount = 1,
+                      graphFileName = None, ratFileName = None, stepCount = None, extraArgs = []):
+    graphDimension, graphType, ratType, ratLoad, pstepCount, updateFlag, seed = params
 
-    ratFileName = dataDir + "/" + rname(graphDimension, ratType, ratLoad)
+    if graphFileName is None:
+        graphFileName = dataDir + "/" + gname(graphDimension, graphType)
+
+    if ratFileName is None:
+        ratFileName = dataDir + "/" + rname(graphDimension, ratType, ratLoad)
+
+    if stepCount is None:
+        stepCount = pstepCount
 
     prog = ''
     prelist = []
@@ -100,35 +180,117 @@ def regressionCommand(params, standard = True, processCount = 1):
     else:
         prog = testProg
 
-    cmd = prelist + [prog, "-g", graphFileName, "-r", ratFileName, "-n", str(stepCount), "-s", str(seed)]
+    cmd = prelist + [prog, "-g", graphFileName]
+    if ratFileName != "":
+        cmd += ["-r", ratFileName]
+    cmd += ["-n", str(stepCount), "-s", str(seed), "-u", updateFlag]
 
     if standard:
         cmd += ["-m", "d"]
-    return cmd
-
+    return cmd + extraArgs
 
 
-def runSim(params, standard = True, processCount = 1):
-    cmd = regressionCommand(params, standard, processCount)
+def runCommand(cmd, fname):
     cmdLine = " ".join(cmd)
-
-    pname = cacheDir + "/" + regressionName(params, standard)
+    pname = cacheDir + "/" + fname
     try:
         outFile = open(pname, 'w')
     except Exception as e:
         sys.stderr.write("Couldn't open file '%s' to write.  %s\n" % (pname, e))
         return False
     try:
-        sys.stderr.write("Executing " + cmdLine + " > " + regressionName(params, standard) + "\n")
+        sys.stderr.write("Executing " + cmdLine + " > " + fname + "\n")
         simProcess = subprocess.Popen(cmd, stdout = outFile)
         simProcess.wait()
         outFile.close()
     except Exception as e:
-        sys.stderr.write("Couldn't execute " + cmdLine + " > " + regressionName(params, standard) + " " + str(e) + "\n")
+        sys.stderr.write("Couldn't execute " + cmdLine + " > " + fname + " " + str(e) + "\n")
         outFile.close()
         return False
+    if simProcess.returncode != 0:
+        sys.stderr.write("Command " + cmdLine + " exited with status %d\n" % simProcess.returncode)
+        return False
     return True
 
+def runSim(params, standard = True, processCount = 1):
+    cmd = regressionCommand(params, standard, processCount)
+    return runCommand(cmd, regressionName(params, standard))
+
+# Run with checkpoint after stepCount steps, and then restart.
+# Splice output of the two runs, each of which includes the state at the checkpoint
+def runCheckpoint(params, stepCount, firstCount, restartCount, testName):
+    cname = cacheDir + "/" + testName[:-4] + ".ckpt"
+    for fname in glob.glob(cname + "*"):
+        os.remove(fname)
+    firstName = testName[:-4] + "-first.txt"
+    restartName = testName[:-4] + "-restart.txt"
+    cmd = regressionCommand(params, False, firstCount, stepCount = stepCount, extraArgs = ["-c", cname])
+    if not runCommand(cmd, firstName):
+        return False
+    cmd = regressionCommand(params, False, restartCount, ratFileName = "", extraArgs = ["-C", cname])
+    if not runCommand(cmd, restartName):
+        return False
+    try:
+        outFile = open(cacheDir + "/" + testName, 'w')
+        stepsSeen = 0
+        for line in open(cacheDir + "/" + firstName, 'r'):
+            if line.startswith("STEP"):
+                stepsSeen += 1
+            if stepsSeen > stepCount:
+                break
+            outFile.write(line)
+        for line in open(cacheDir + "/" + restartName, 'r'):
+            outFile.write(line)
+        outFile.close()
+    except Exception as e:
+        sys.stderr.write("Couldn't combine outputs of checkpoint and restart.  %s\n" % str(e))
+        return False
+    return True
+
+# Run with binary versions of graph and rat files
+def runBinary(params, processCount, testName):
+    graphDimension, graphType, ratType, ratLoad, stepCount, updateFlag, seed = params
+    graphFileName = cacheDir + "/" + gname(graphDimension, graphType) + ".bin"
+    ratFileName = cacheDir + "/" + rname(graphDimension, ratType, ratLoad) + ".bin"
+    cmd = [convertProg, "-g", dataDir + "/" + gname(graphDimension, graphType), "-G", graphFileName,
+           "-r", dataDir + "/" + rname(graphDimension, ratType, ratLoad), "-R", ratFileName]
+    if not runCommand(cmd, testName[:-4] + "-convert.txt"):
+        return False
+    cmd = regressionCommand(params, False, processCount, graphFileName = graphFileName, ratFileName = ratFileName)
+    return runCommand(cmd, testName)
+
+# Run with graph file having no zones, optionally converted to binary
+def runZoneless(params, binary, processCount, testName):
+    graphDimension, graphType, ratType, ratLoad, stepCount, updateFlag, seed = params
+    graphFileName = cacheDir + "/" + gname(graphDimension, graphType) + ".nozone"
+    try:
+        outFile = open(graphFileName, 'w')
+        first = True
+        for line in open(dataDir + "/" + gname(graphDimension, graphType), 'r'):
+            if first:
+                # Header gives node and edge counts only
+                line = " ".join(line.split()[:2]) + "\n"
+                first = False
+            elif line.startswith("z"):
+                continue
+            outFile.write(line)
+        outFile.close()
+    except Exception as e:
+        sys.stderr.write("Couldn't strip zones from graph file.  %s\n" % str(e))
+        return False
+    if binary:
+        cmd = [convertProg, "-g", graphFileName, "-G", graphFileName + ".bin"]
+        if not runCommand(cmd, testName[:-4] + "-convert.txt"):
+            return False
+        graphFileName += ".bin"
+    cmd = regressionCommand(params, False, processCount, graphFileName = graphFileName)
+    return runCommand(cmd, testName)
+
+# Run ensemble of replicas, writing output of replica i to testName.i
+def runEnsemble(params, replicaCount, testName):
+    cmd = regressionCommand(params, False, 1, extraArgs = ["-e", str(replicaCount), "-f", cacheDir + "/" + testName])
+    return runCommand(cmd, testName[:-4] + "-ensemble.txt")
+
 def checkFiles(refPath, testPath):
     badLines = 0
     lineNumber = 0
@@ -187,6 +349,45 @@ def regress(params, processCount):
 
     return checkFiles(refPath, testPath)
 
+def regressVariant(params, variant, arg, processCount):
+    testName = variantName(params, variant, arg)
+    sys.stderr.write("+++++++++++++++++ Regression %s +++++++++++++++\n" % testName[4:])
+    refPath = cacheDir + "/" + regressionName(params, standard = True)
+    if not os.path.exists(refPath):
+        if not runSim(params, standard = True):
+            sys.stderr.write("Failed to run simulation with reference simulator\n")
+            return False
+
+    if variant == 'e':
+        if not runEnsemble(params, arg, testName):
+            sys.stderr.write("Failed to run simulation with test simulator\n")
+            return False
+        ok = True
+        for i in range(arg):
+            rparams = params[:-1] + (params[-1] + i,)
+            refPath = cacheDir + "/" + regressionName(rparams, standard = True)
+            if not os.path.exists(refPath) and not runSim(rparams, standard = True):
+                sys.stderr.write("Failed to run simulation with reference simulator\n")
+                return False
+            ok = checkFiles(refPath, cacheDir + "/" + testName + ".%d" % i) and ok
+        return ok
+    elif variant == 'c':
+        stepCount, firstCode, restartCode = arg
+        ok = runCheckpoint(params, stepCount, variantProcessCount(firstCode, processCount),
+                           variantProcessCount(restartCode, processCount), testName)
+    elif variant == 'g':
+        ok = runBinary(params, processCount, testName)
+    elif variant == 'z':
+        ok = runZoneless(params, arg, processCount, testName)
+    else:
+        cmd = regressionCommand(params, False, processCount, extraArgs = arg)
+        ok = runCommand(cmd, testName)
+    if not ok:
+        sys.stderr.write("Failed to run simulation with test simulator\n")
+        return False
+
+    return checkFiles(refPath, cacheDir + "/" + testName)
+
 def run(flushCache, processCount, doAll):
 
     if flushCache and os.path.exists(cacheDir):
@@ -211,7 +412,14 @@ def run(flushCache, processCount, doAll):
             goodCount += 1
         else:
             sys.stderr.write("Regression %s Failed\n" % regressionName(p, standard = False))
-    totalCount = len(rlist)
+    for (p, variant, arg) in variantRegressionList:
+        allCount += 1
+        if regressVariant(p, variant, arg, processCount):
+            sys.stderr.write("Regression %s Passed\n" % variantName(p, variant, arg))
+            goodCount += 1
+        else:
+            sys.stderr.write("Regression %s Failed\n" % variantName(p, variant, arg))
+    totalCount = len(rlist) + len(variantRegressionList)
     message = "SUCCESS" if goodCount == totalCount else "FAILED"
     sys.stderr.write("Regression set size %d.  %d/%d tests successful. %s\n" % (totalCount, goodCount, allCount, message))
 
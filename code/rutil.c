@@ -6,6 +6,13 @@
 #include "rutil.h"
 #include <stdio.h>
 
+#if defined(__GNUC__) && defined(__x86_64__)
+#define RUTIL_X86 1
+#include <immintrin.h>
+#else
+#define RUTIL_X86 0
+#endif
+
 /* Standard parameters */
 #define GROUPSIZE 2147483647
 #define MVAL  48271
@@ -35,6 +42,98 @@ double next_random_float(random_t *seedp, double upperlimit) {
     return ((double) val / (double) GROUPSIZE) * upperlimit;
 }
 
+/*
+  Compute next value for seed with x = 0, using the fact that GROUPSIZE = 2^31-1 is a Mersenne prime.
+  seed * MVAL + VVAL < 2^47, so that a single folding of the upper bits
+  gives a value < 2*GROUPSIZE.
+*/
+static inline random_t rnext_mersenne(random_t seed) {
+    uint64_t t = (uint64_t) seed * MVAL + VVAL;
+    t = (t & GROUPSIZE) + (t >> 31);
+    if (t >= GROUPSIZE)
+	t -= GROUPSIZE;
+    return (random_t) t;
+}
+
+static void next_random_batch_scalar(random_t *seeds, double *vals, size_t n) {
+    size_t i;
+    for (i = 0; i < n; i++) {
+	random_t val = rnext_mersenne(seeds[i]);
+	seeds[i] = val;
+	vals[i] = (double) val / (double) GROUPSIZE;
+    }
+}
+
+#if RUTIL_X86
+/* Four seeds per iteration, with 64-bit products */
+__attribute__((target("avx2")))
+static void next_random_batch_avx2(random_t *seeds, double *vals, size_t n) {
+    size_t i;
+    __m256i mval = _mm256_set1_epi64x(MVAL);
+    __m256i vval = _mm256_set1_epi64x(VVAL);
+    __m256i group = _mm256_set1_epi64x(GROUPSIZE);
+    __m256i limit = _mm256_set1_epi64x(GROUPSIZE-1);
+    __m256i pack = _mm256_setr_epi32(0, 2, 4, 6, 1, 3, 5, 7);
+    __m256d divisor = _mm256_set1_pd((double) GROUPSIZE);
+    for (i = 0; i + 4 <= n; i += 4) {
+	__m256i s = _mm256_cvtepu32_epi64(_mm_loadu_si128((__m128i *) &seeds[i]));
+	__m256i t = _mm256_add_epi64(_mm256_mul_epu32(s, mval), vval);
+	t = _mm256_add_epi64(_mm256_and_si256(t, group), _mm256_srli_epi64(t, 31));
+	__m256i over = _mm256_cmpgt_epi64(t, limit);
+	t = _mm256_sub_epi64(t, _mm256_and_si256(over, group));
+	__m128i val = _mm256_castsi256_si128(_mm256_permutevar8x32_epi32(t, pack));
+	_mm_storeu_si128((__m128i *) &seeds[i], val);
+	_mm256_storeu_pd(&vals[i], _mm256_div_pd(_mm256_cvtepi32_pd(val), divisor));
+    }
+    next_random_batch_scalar(seeds + i, vals + i, n - i);
+}
+
+/* Eight seeds per iteration */
+__attribute__((target("avx512f")))
+static void next_random_batch_avx512(random_t *seeds, double *vals, size_t n) {
+    size_t i;
+    __m512i mval = _mm512_set1_epi64(MVAL);
+    __m512i vval = _mm512_set1_epi64(VVAL);
+    __m512i group = _mm512_set1_epi64(GROUPSIZE);
+    __m512d divisor = _mm512_set1_pd((double) GROUPSIZE);
+    for (i = 0; i + 8 <= n; i += 8) {
+	__m512i s = _mm512_cvtepu32_epi64(_mm256_loadu_si256((__m256i *) &seeds[i]));
+	__m512i t = _mm512_add_epi64(_mm512_mul_epu32(s, mval), vval);
+	t = _mm512_add_epi64(_mm512_and_si512(t, group), _mm512_srli_epi64(t, 31));
+	__mmask8 over = _mm512_cmpge_epu64_mask(t, group);
+	t = _mm512_mask_sub_epi64(t, over, t, group);
+	__m256i val = _mm512_cvtepi64_epi32(t);
+	_mm256_storeu_si256((__m256i *) &seeds[i], val);
+	_mm512_storeu_pd(&vals[i], _mm512_div_pd(_mm512_cvtepi32_pd(val), divisor));
+    }
+    next_random_batch_scalar(seeds + i, vals + i, n - i);
+}
+#endif
+
+typedef void (*batch_fun_t)(random_t *seeds, double *vals, size_t n);
+
+static batch_fun_t batch_fun = next_random_batch_scalar;
+
+/*
+  Choose best implementation supported by processor.
+  Runs at program start, before any threads exist, since
+  the replicas of an ensemble draw batches concurrently
+ */
+__attribute__((constructor))
+static void choose_batch_fun() {
+#if RUTIL_X86
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx512f"))
+	batch_fun = next_random_batch_avx512;
+    else if (__builtin_cpu_supports("avx2"))
+	batch_fun = next_random_batch_avx2;
+#endif
+}
+
+void next_random_batch(random_t *seeds, double *vals, size_t n) {
+    batch_fun(seeds, vals, n);
+}
+
 /* Select sample of size up to maxSample (without replacement) from list or size populationCount */
 /* Store result in array dest.  Array scratch must have space for sampleCount entries. */
 /* Returns minimum of populationCount and maxSample */
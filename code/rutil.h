@@ -24,6 +24,13 @@ void reseed(random_t *seedp, random_t seed_list[], size_t len);
 /* Generate double in range [0.0, upperlimit) */
 double next_random_float(random_t *seedp, double upperlimit);
 
+/*
+  Advance each of seeds[0] .. seeds[n-1] once, storing values in range [0.0, 1.0) in vals.
+  vals[i] * upperlimit equals next_random_float(&seeds[i], upperlimit)
+  Uses SIMD instructions when available.
+*/
+void next_random_batch(random_t *seeds, double *vals, size_t n);
+
 /* Select sample of size up to maxSample (without replacement) from list or size populationCount
  * Store result in array dest.  Array scratch must have space for sampleCount entries.
  * Returns minimum of populationCount and maxSample */
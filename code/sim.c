@@ -1,77 +1,362 @@
 #include "crun.h"
 
+#if MPI
+/* Message tags for exchanges between zones */
+#define TAG_RAT 1
+#define TAG_COUNT 2
+#define TAG_WEIGHT 3
+#endif
+
+/*
+  Imbalance for counts beyond the tabulated ones.  Gives the same value
+  as imbalance(), but skips the logarithm when the ratio of counts is
+  large enough that the result is certain to be clipped
+ */
+static inline double large_imbalance(int lcount, int rcount) {
+    if (lcount > 0 && (double) rcount > IMBALANCE_CLIP_RATIO * lcount)
+	return 1.0;
+    if (rcount > 0 && (double) lcount > IMBALANCE_CLIP_RATIO * rcount)
+	return -1.0;
+    return imbalance(lcount, rcount);
+}
+
+/*
+  Count at node nid, from whichever of the narrow and wide count arrays
+  is non-NULL.  Weight computations take both arrays as arguments, and
+  compute_weight() passes a constant NULL for one of them, so that once
+  inlined, each version reads its counts without testing which is in use
+ */
+static inline int count_at(count_t *narrow, int *wide, int nid) {
+    return wide == NULL ? narrow[nid] : wide[nid];
+}
+
+/*
+  Sum imbalances for hub node.  Imbalances are saved for each neighbor,
+  and only recomputed for neighbors whose counts have changed,
+  or for all neighbors when the hub's own count has changed.
+ */
+static inline double hub_imbalance_sum(state_t *s, int nid, int lcount, count_t *narrow, int *wide) {
+    graph_t *g = s->g;
+    int estart = g->neighbor_start[nid]+1;
+    int outdegree = g->neighbor_start[nid+1] - estart;
+    int *start = &g->neighbor[estart];
+    int hstart = s->hub_imbalance_start[nid];
+    double *saved = &s->hub_imbalance[hstart];
+    int *saved_rcount = &s->hub_imbalance_rcount[hstart];
+    bool all = s->hub_imbalance_lcount[nid] != lcount;
+    int limit = s->imbalance_limit;
+    double *row = lcount < limit ? &s->imbalance_table[lcount * limit] : NULL;
+    int i;
+    double sum = 0.0;
+    s->hub_imbalance_lcount[nid] = lcount;
+    for (i = 0; i < outdegree; i++) {
+	int rcount = count_at(narrow, wide, start[i]);
+	if (all || rcount != saved_rcount[i]) {
+	    saved_rcount[i] = rcount;
+	    saved[i] = lcount < limit && rcount < limit ? row[rcount] : large_imbalance(lcount, rcount);
+	}
+	sum += saved[i];
+    }
+    return sum;
+}
 
 /* Compute ideal load factor (ILF) for node */
-static inline double neighbor_ilf(state_t *s, int nid) {
+static inline double neighbor_ilf(state_t *s, int nid, count_t *narrow, int *wide) {
     graph_t *g = s->g;
     int outdegree = g->neighbor_start[nid+1] - g->neighbor_start[nid] - 1;
     int *start = &g->neighbor[g->neighbor_start[nid]+1];
     int i;
     double sum = 0.0;
-    for (i = 0; i < outdegree; i++) {
-	int lcount = s->rat_count[nid];
-	int rcount = s->rat_count[start[i]];
-	double r = imbalance(lcount, rcount);
-	sum += r;
+    int lcount = count_at(narrow, wide, nid);
+    int limit = s->imbalance_limit;
+    if (outdegree >= HUB_THRESHOLD) {
+	sum = hub_imbalance_sum(s, nid, lcount, narrow, wide);
+    } else if (lcount < limit) {
+	/* Use tabulated values when possible */
+	double *row = &s->imbalance_table[lcount * limit];
+	for (i = 0; i < outdegree; i++) {
+	    int rcount = count_at(narrow, wide, start[i]);
+	    double r = rcount < limit ? row[rcount] : large_imbalance(lcount, rcount);
+	    sum += r;
+	}
+    } else {
+	for (i = 0; i < outdegree; i++) {
+	    int rcount = count_at(narrow, wide, start[i]);
+	    double r = large_imbalance(lcount, rcount);
+	    sum += r;
+	}
     }
     double ilf = BASE_ILF + 0.5 * (sum/outdegree);
     return ilf;
 }
 
+/* Look up or compute weight for given count and ILF */
+static inline double cached_mweight(state_t *s, int count, double ilf) {
+    if (WEIGHT_CACHE_SIZE == 0)
+	return mweight((double) count/s->load_factor, ilf);
+    weight_cache_t *cache = s->weight_cache;
+#ifdef _OPENMP
+    cache += omp_get_thread_num() * WEIGHT_CACHE_SIZE;
+#endif
+    /* Hash bits of ILF together with count */
+    uint64_t bits;
+    memcpy(&bits, &ilf, sizeof(bits));
+    uint64_t h = (bits ^ (bits >> 29) ^ (uint64_t) count * 0x9E3779B97F4A7C15ULL);
+    h ^= h >> 32;
+    weight_cache_t *entry = &cache[h & (WEIGHT_CACHE_SIZE-1)];
+    if (entry->count != count || entry->ilf != ilf) {
+	entry->count = count;
+	entry->ilf = ilf;
+	entry->weight = mweight((double) count/s->load_factor, ilf);
+    }
+    return entry->weight;
+}
+
 /* Compute weight for node nid */
 static inline double compute_weight(state_t *s, int nid) {
-    int count = s->rat_count[nid];
-    double ilf = neighbor_ilf(s, nid);
-    return mweight((double) count/s->load_factor, ilf);
+    if (s->rat_count == NULL) {
+	double ilf = neighbor_ilf(s, nid, s->short_count, NULL);
+	return cached_mweight(s, s->short_count[nid], ilf);
+    } else {
+	double ilf = neighbor_ilf(s, nid, NULL, s->rat_count);
+	return cached_mweight(s, s->rat_count[nid], ilf);
+    }
 }
 
 
 /* Recompute all node counts according to rat population */
 /*
-  Function only called at start of simulation, at which point
-  every zone has complete rat information.  Can therefore
-  have every zone update every node count.
+  Function only called at start of simulation.  Each zone
+  counts its own rats, giving valid counts for its own nodes.
+  Counts for nodes in other zones must be imported.
+  Counts are widened if any of them doesn't fit in count_t.
 */
 static inline void take_census(state_t *s) {
     graph_t *g = s->g;
     int nnode = g->nnode;
     int *rat_position = s->rat_position;
-    int *rat_count = s->rat_count;
-    int nrat = s->nrat;
+    int nrat = s->local_rat_count;
+    int ri;
 
+    if (s->rat_count == NULL) {
+	count_t *short_count = s->short_count;
+	memset(short_count, 0, nnode * sizeof(count_t));
+	for (ri = 0; ri < nrat; ri++) {
+	    int nid = rat_position[ri];
+	    if (short_count[nid] == COUNT_MAX) {
+		widen_counts(s);
+		break;
+	    }
+	    short_count[nid]++;
+	}
+	if (ri == nrat)
+	    return;
+    }
+    int *rat_count = s->rat_count;
     memset(rat_count, 0, nnode * sizeof(int));
-    int ri;
     for (ri = 0; ri < nrat; ri++) {
 	rat_count[rat_position[ri]]++;
     }
 }
 
-/* Recompute all node weights */
+/* Is node nid in this zone? */
+static inline bool local_node(graph_t *g, int nid) {
+    return g->zone_id[nid] == g->this_zone;
+}
+
+/* Record that the rat count for node nid has changed */
+static inline void mark_count_changed(state_t *s, int nid) {
+    if (!s->count_changed[nid]) {
+	s->count_changed[nid] = true;
+	s->count_changed_list[s->count_changed_count++] = nid;
+    }
+}
+
+/*
+  Update load statistics after count of local node nid has changed by delta (+1 or -1).
+  Histogram of counts lets the extreme counts be tracked in constant time
+ */
+static inline void stat_count_changed(state_t *s, int nid, int delta) {
+    if (!s->stats)
+	return;
+    int *hist = s->stat_count_hist;
+    int ncount = node_count(s, nid);
+    int ocount = ncount - delta;
+    if (ncount >= s->stat_hist_capacity) {
+	hist = grow_stat_hist(s, ncount);
+	if (hist == NULL) {
+	    outmsg("Couldn't allocate space for load statistics.  Exiting");
+	    exit(1);
+	}
+    }
+    hist[ocount]--;
+    hist[ncount]++;
+    s->stat_sum_sq += (int64_t) ncount * ncount - (int64_t) ocount * ocount;
+    s->stat_zone_total[s->g->nfzone > 0 ? s->g->fzone_id[nid] : 0] += delta;
+    if (ncount > s->stat_max)
+	s->stat_max = ncount;
+    if (ncount < s->stat_min)
+	s->stat_min = ncount;
+    while (hist[s->stat_max] == 0)
+	s->stat_max--;
+    while (hist[s->stat_min] == 0)
+	s->stat_min++;
+}
+
+/* Record that the weight for node nid has changed */
+static inline void mark_weight_changed(state_t *s, int nid) {
+    if (!s->weight_changed[nid]) {
+	s->weight_changed[nid] = true;
+	s->weight_changed_list[s->weight_changed_count++] = nid;
+    }
+}
+
+/* Recompute weights for all nodes in this zone */
 static inline void compute_all_weights(state_t *s) {
-    int nid;
+    int i;
     graph_t *g = s->g;
-    double *node_weight = s->node_weight;
-    for (nid = 0; nid < g->nnode; nid++)
+    weight_t *node_weight = s->node_weight;
+    for (i = 0; i < s->count_changed_count; i++)
+	s->count_changed[s->count_changed_list[i]] = false;
+    s->count_changed_count = 0;
+    for (i = 0; i < s->weight_changed_count; i++)
+	s->weight_changed[s->weight_changed_list[i]] = false;
+    s->weight_changed_count = 0;
+#pragma omp parallel for schedule(static) if (g->local_node_count >= PARALLEL_THRESHOLD)
+    for (i = 0; i < g->local_node_count; i++) {
+	int nid = g->local_node_list[i];
 	node_weight[nid] = compute_weight(s, nid);
+    }
+    s->all_weights_changed = true;
+}
 
+/*
+  Recompute weights for nodes whose counts have changed, as well as
+  for their neighbors, since their ILFs depend on those counts.
+  Revert to computing all weights when too many nodes have changed.
+ */
+static inline void update_weights(state_t *s) {
+    graph_t *g = s->g;
+    int ccount = s->count_changed_count;
+    int i, eid;
+    if (!INCREMENTAL_UPDATE || ccount > INCREMENTAL_FRACTION * g->local_node_count) {
+	compute_all_weights(s);
+	return;
+    }
+    int wstart = s->weight_changed_count;
+    int wcount = wstart;
+    for (i = 0; i < ccount; i++) {
+	int nid = s->count_changed_list[i];
+	s->count_changed[nid] = false;
+	for (eid = g->neighbor_start[nid]; eid < g->neighbor_start[nid+1]; eid++) {
+	    int nbrnid = g->neighbor[eid];
+	    if (!s->weight_changed[nbrnid] && local_node(g, nbrnid)) {
+		s->weight_changed[nbrnid] = true;
+		s->weight_changed_list[wcount++] = nbrnid;
+	    }
+	}
+    }
+    s->count_changed_count = 0;
+    s->weight_changed_count = wcount;
+#pragma omp parallel for schedule(static) if (wcount - wstart >= PARALLEL_THRESHOLD)
+    for (i = wstart; i < wcount; i++) {
+	int nid = s->weight_changed_list[i];
+	s->node_weight[nid] = compute_weight(s, nid);
+    }
 }
 
 
 
-/* In synchronous or batch mode, can precompute sums for each region */
+/* Compute sum of weights and cumulative weights for region of node nid */
+static inline void find_sums(state_t *s, int nid) {
+    graph_t *g = s->g;
+    int eid;
+    weight_t sum = 0.0;
+    for (eid = g->neighbor_start[nid]; eid < g->neighbor_start[nid+1]; eid++) {
+	sum += s->node_weight[g->neighbor[eid]];
+	s->neighbor_accum_weight[eid] = sum;
+    }
+    s->sum_weight[nid] = sum;
+}
+
+/* In synchronous or batch mode, can precompute sums for each region in this zone */
 static inline void find_all_sums(state_t *s) {
     graph_t *g = s->g;
     init_sum_weight(s);
-    // TODO: It doesn't make sense to compute the weights for nodes that are not
-    // in the local zone
-    int nid, eid;
-    for (nid = 0; nid < g->nnode; nid++) {
-	double sum = 0.0;
+    int i;
+#pragma omp parallel for schedule(static) if (g->local_node_count >= PARALLEL_THRESHOLD)
+    for (i = 0; i < g->local_node_count; i++)
+	find_sums(s, g->local_node_list[i]);
+}
+
+/*
+  With lazy sums, mark regions containing a node whose weight has changed as stale.
+  They get recomputed when a rat needs them.
+ */
+static inline void mark_stale_sums(state_t *s) {
+    graph_t *g = s->g;
+    int wcount = s->weight_changed_count;
+    int i, eid;
+    if (s->all_weights_changed) {
+	init_sum_weight(s);
+	for (i = 0; i < g->local_node_count; i++)
+	    s->sum_changed[g->local_node_list[i]] = true;
+    }
+    for (i = 0; i < wcount; i++) {
+	int nid = s->weight_changed_list[i];
+	s->weight_changed[nid] = false;
+	if (s->all_weights_changed)
+	    continue;
 	for (eid = g->neighbor_start[nid]; eid < g->neighbor_start[nid+1]; eid++) {
-	    sum += s->node_weight[g->neighbor[eid]];
-	    s->neighbor_accum_weight[eid] = sum;
+	    int nbrnid = g->neighbor[eid];
+	    if (local_node(g, nbrnid))
+		s->sum_changed[nbrnid] = true;
 	}
-	s->sum_weight[nid] = sum;
+    }
+    s->weight_changed_count = 0;
+    s->all_weights_changed = false;
+}
+
+/*
+  Recompute sums only for regions containing a node whose weight
+  has changed.  Summation order is unchanged, so the results are
+  identical to those of find_all_sums.
+  Revert to computing all sums when too many weights have changed.
+ */
+static inline void update_sums(state_t *s) {
+    graph_t *g = s->g;
+    int wcount = s->weight_changed_count;
+    int i, eid;
+    if (s->lazy_sums) {
+	mark_stale_sums(s);
+	return;
+    }
+    if (!INCREMENTAL_UPDATE || s->all_weights_changed || wcount > INCREMENTAL_FRACTION * g->local_node_count) {
+	for (i = 0; i < wcount; i++)
+	    s->weight_changed[s->weight_changed_list[i]] = false;
+	s->weight_changed_count = 0;
+	s->all_weights_changed = false;
+	find_all_sums(s);
+	return;
+    }
+    int scount = 0;
+    for (i = 0; i < wcount; i++) {
+	int nid = s->weight_changed_list[i];
+	s->weight_changed[nid] = false;
+	for (eid = g->neighbor_start[nid]; eid < g->neighbor_start[nid+1]; eid++) {
+	    int nbrnid = g->neighbor[eid];
+	    if (!s->sum_changed[nbrnid] && local_node(g, nbrnid)) {
+		s->sum_changed[nbrnid] = true;
+		s->sum_changed_list[scount++] = nbrnid;
+	    }
+	}
+    }
+    s->weight_changed_count = 0;
+#pragma omp parallel for schedule(static) if (scount >= PARALLEL_THRESHOLD)
+    for (i = 0; i < scount; i++) {
+	int nid = s->sum_changed_list[i];
+	s->sum_changed[nid] = false;
+	find_sums(s, nid);
     }
 }
 
@@ -83,7 +368,7 @@ static inline void find_all_sums(state_t *s) {
 /*
   Linear search
  */
-static inline int locate_value_linear(double target, double *list, int len) {
+static inline int locate_value_linear(double target, weight_t *list, int len) {
     int i;
     for (i = 0; i < len; i++)
 	if (target < list[i])
@@ -94,7 +379,7 @@ static inline int locate_value_linear(double target, double *list, int len) {
 /*
   Binary search down to threshold, and then linear
  */
-static inline int locate_value(double target, double *list, int len) {
+static inline int locate_value(double target, weight_t *list, int len) {
     int left = 0;
     int right = len-1;
     while (left < right) {
@@ -109,24 +394,46 @@ static inline int locate_value(double target, double *list, int len) {
     return right;
 }
 
+/*
+  Branch-free binary search for large (hub) regions.  The comparisons
+  compile to conditional moves, avoiding mispredicted branches.
+  Gives the same index as locate_value
+ */
+static inline int locate_value_hub(double target, weight_t *list, int len) {
+    int base = 0;
+    int n = len;
+    while (n > 1) {
+	int half = n/2;
+	base = target < list[base+half-1] ? base : base+half;
+	n -= half;
+    }
+    return base;
+}
+
 
 /*
   Version that can be used in synchronous or batch mode, where certain that node weights are already valid.
   And have already computed sum of weights for each node, and cumulative weight for each neighbor
   Given list of integer counts, generate real-valued weights
   and use these to flip random coin returning value between 0 and len-1
+  Random value u in [0.0, 1.0) has already been drawn from rat's seed.
 */
-static inline int fast_next_random_move(state_t *s, int r) {
+static inline int fast_next_random_move(state_t *s, int r, double u) {
     int nid = s->rat_position[r];
     graph_t *g = s->g;
-    random_t *seedp = &s->rat_seed[r];
+    if (s->lazy_sums && s->sum_changed[nid]) {
+	find_sums(s, nid);
+	s->sum_changed[nid] = false;
+    }
     /* Guaranteed that have computed sum of weights */
     double tsum = s->sum_weight[nid];    
-    double val = next_random_float(seedp, tsum);
+    double val = u * tsum;
 
     int estart = g->neighbor_start[nid];
     int elen = g->neighbor_start[nid+1] - estart;
-    int offset = locate_value(val, &s->neighbor_accum_weight[estart], elen);
+    int offset = elen >= HUB_THRESHOLD ?
+	locate_value_hub(val, &s->neighbor_accum_weight[estart], elen) :
+	locate_value(val, &s->neighbor_accum_weight[estart], elen);
 #if DEBUG
     if (offset < 0) {
 	/* Shouldn't get here */
@@ -141,29 +448,408 @@ static inline int fast_next_random_move(state_t *s, int r) {
     return g->neighbor[estart + offset];
 }
 
-/* Process single batch */
-// TODO: Here's where things get interesting!
-//    * Process rats currently in this zone
-//    * Export rats that move out of this zone
-//    * Import rats that move into this zone
-//    * Export counts for internal nodes adjacent to other zones
-//    * Import counts for external nodes adjacent to this zone
-//    * Compute weights for nodes in this zone
-//    * Export weights for internal nodes adjacent to other zones
-//    * Import weights for external nodes adjacent to this zone
-static inline void do_batch(state_t *s, int batch, int bstart, int bcount) {
+#if MPI
+/*
+  Post receives and sends for exchanging values of boundary nodes with each neighboring zone.
+  Values for exported nodes must already be in the export buffers.
+ */
+static void exchange_boundary(state_t *s, void **export_buffer, void **import_buffer,
+			      MPI_Datatype dtype, int tag) {
+    graph_t *g = s->g;
+    int nreq = 0;
+    int z;
+    for (z = 0; z < g->nzone; z++) {
+	if (g->import_node_count[z] == 0)
+	    continue;
+	MPI_Irecv(import_buffer[z], g->import_node_count[z], dtype, z, tag,
+		  MPI_COMM_WORLD, &s->request[nreq++]);
+    }
+    for (z = 0; z < g->nzone; z++) {
+	if (g->export_node_count[z] == 0)
+	    continue;
+	MPI_Isend(export_buffer[z], g->export_node_count[z], dtype, z, tag,
+		  MPI_COMM_WORLD, &s->request[nreq++]);
+    }
+    MPI_Waitall(nreq, s->request, MPI_STATUSES_IGNORE);
+}
+
+/* Export counts for nodes adjacent to other zones and import counts for their nodes */
+static void exchange_counts(state_t *s) {
+    graph_t *g = s->g;
+    int z, i;
+    for (z = 0; z < g->nzone; z++) {
+	for (i = 0; i < g->export_node_count[z]; i++)
+	    s->export_count_buffer[z][i] = node_count(s, g->export_node_list[z][i]);
+    }
+    exchange_boundary(s, (void **) s->export_count_buffer, (void **) s->import_count_buffer,
+		      MPI_INT, TAG_COUNT);
+    for (z = 0; z < g->nzone; z++) {
+	for (i = 0; i < g->import_node_count[z]; i++) {
+	    int nid = g->import_node_list[z][i];
+	    int count = s->import_count_buffer[z][i];
+	    if (node_count(s, nid) != count) {
+		set_node_count(s, nid, count);
+		mark_count_changed(s, nid);
+	    }
+	}
+    }
+}
+
+/* Export weights for nodes adjacent to other zones and import weights for their nodes */
+static void exchange_weights(state_t *s) {
+    graph_t *g = s->g;
+    int z, i;
+    for (z = 0; z < g->nzone; z++) {
+	for (i = 0; i < g->export_node_count[z]; i++)
+	    s->export_weight_buffer[z][i] = s->node_weight[g->export_node_list[z][i]];
+    }
+    exchange_boundary(s, (void **) s->export_weight_buffer, (void **) s->import_weight_buffer,
+		      MPI_WEIGHT, TAG_WEIGHT);
+    for (z = 0; z < g->nzone; z++) {
+	for (i = 0; i < g->import_node_count[z]; i++) {
+	    int nid = g->import_node_list[z][i];
+	    weight_t weight = s->import_weight_buffer[z][i];
+	    if (s->node_weight[nid] != weight) {
+		s->node_weight[nid] = weight;
+		mark_weight_changed(s, nid);
+	    }
+	}
+    }
+}
+
+/*
+  Queue local rat ri for transfer to the zone containing node nnid.
+  Node is sent with its number in the full graph
+ */
+static inline void export_rat(state_t *s, int ri, int nnid) {
+    ibuf_t *buf = &s->export_rat_buffer[s->g->zone_id[nnid]];
+    ibuf_reserve(buf, buf->count + 3);
+    buf->data[buf->count++] = s->rat_id[ri];
+    buf->data[buf->count++] = global_node(s->g, nnid);
+    buf->data[buf->count++] = (int) s->rat_seed[ri];
+}
+
+/*
+  Send rats that moved out of this zone and receive those that moved in.
+  Arriving rats have already moved for this step.
+  They get merged into the local rat list by merge_rats
+ */
+static void exchange_rats(state_t *s) {
+    graph_t *g = s->g;
+    int nreq = 0;
+    int z, i;
+    for (z = 0; z < g->nzone; z++) {
+	if (g->export_node_count[z] == 0)
+	    continue;
+	ibuf_t *buf = &s->export_rat_buffer[z];
+	MPI_Isend(buf->data, buf->count, MPI_INT, z, TAG_RAT,
+		  MPI_COMM_WORLD, &s->request[nreq++]);
+    }
+    ibuf_t *ibuf = &s->import_rat_buffer;
+    for (z = 0; z < g->nzone; z++) {
+	if (g->import_node_count[z] == 0)
+	    continue;
+	MPI_Status status;
+	int count;
+	MPI_Probe(z, TAG_RAT, MPI_COMM_WORLD, &status);
+	MPI_Get_count(&status, MPI_INT, &count);
+	ibuf_reserve(ibuf, ibuf->count + count);
+	MPI_Recv(ibuf->data + ibuf->count, count, MPI_INT, z, TAG_RAT,
+		 MPI_COMM_WORLD, MPI_STATUS_IGNORE);
+	for (i = ibuf->count; i < ibuf->count + count; i += 3) {
+	    int nnid = subgraph_node(g, ibuf->data[i+1]);
+	    ibuf->data[i+1] = nnid;
+	    set_node_count(s, nnid, node_count(s, nnid) + 1);
+	    mark_count_changed(s, nnid);
+	    stat_count_changed(s, nnid, 1);
+	}
+	ibuf->count += count;
+    }
+    MPI_Waitall(nreq, s->request, MPI_STATUSES_IGNORE);
+    for (z = 0; z < g->nzone; z++)
+	s->export_rat_buffer[z].count = 0;
+}
+
+/*
+  At end of step, remove rats that left this zone and merge in those that arrived,
+  keeping the local rats ordered by rat id.  Works in place: remaining rats
+  are first packed toward the front, and then merged with the arrivals
+  from the back, so that each slot has been vacated before it is written.
+ */
+static void merge_rats(state_t *s) {
+    ibuf_t *ibuf = &s->import_rat_buffer;
+    int nimport = ibuf->count / 3;
+    int ri, ni;
+    /* Sorts (id, node, seed) triples by rat id */
+    qsort(ibuf->data, nimport, 3 * sizeof(int), comp_int);
+    int nkeep = 0;
+    for (ri = 0; ri < s->local_rat_count; ri++) {
+	if (s->rat_position[ri] < 0)
+	    /* Rat left this zone */
+	    continue;
+	s->rat_id[nkeep] = s->rat_id[ri];
+	s->rat_position[nkeep] = s->rat_position[ri];
+	s->rat_seed[nkeep] = s->rat_seed[ri];
+	nkeep++;
+    }
+    if (!grow_rats(s, nkeep + nimport)) {
+	outmsg("Couldn't allocate space for %d rats.  Exiting", nkeep + nimport);
+	MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    /* When rats are grouped by node, local rats are only ordered by batch */
+    int kdiv = s->group_rats ? s->batch_size : 1;
+    /* Among rats with equal keys, local ones come first */
+    int ii = nimport - 1;
+    ri = nkeep - 1;
+    for (ni = nkeep + nimport - 1; ii >= 0; ni--) {
+	if (ri >= 0 && s->rat_id[ri]/kdiv > ibuf->data[3*ii]/kdiv) {
+	    s->rat_id[ni] = s->rat_id[ri];
+	    s->rat_position[ni] = s->rat_position[ri];
+	    s->rat_seed[ni] = s->rat_seed[ri];
+	    ri--;
+	} else {
+	    s->rat_id[ni] = ibuf->data[3*ii];
+	    s->rat_position[ni] = ibuf->data[3*ii+1];
+	    s->rat_seed[ni] = (random_t) ibuf->data[3*ii+2];
+	    ii--;
+	}
+    }
+    s->local_rat_count = nkeep + nimport;
+    ibuf->count = 0;
+}
+
+/*
+  Reassign file zones to processes according to the current rat population.
+  Rats at nodes changing process are sent to their new process.  Requires
+  every process to have the full graph.  Then the zone's boundaries, counts, and weights are set up afresh, as at the
+  start of the simulation.  Weights and sums depend only on counts, and so
+  results are unchanged.
+ */
+static void rebalance_zones(state_t *s) {
+    graph_t *g = s->g;
+    int nzone = g->nzone;
+    int this_zone = g->this_zone;
+    int ri, z;
+    int64_t *cost = calloc(g->nfzone, sizeof(int64_t));
+    if (cost == NULL) {
+	outmsg("Couldn't allocate space for zone costs.  Exiting");
+	MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    fzone_cost(g, g->local_node_list, g->local_node_count, s->rat_position, s->local_rat_count, cost);
+    MPI_Allreduce(MPI_IN_PLACE, cost, g->nfzone, MPI_INT64_T, MPI_SUM, MPI_COMM_WORLD);
+    bool changed;
+    balance_zones(g, cost, this_zone == 0, &changed);
+    free(cost);
+    if (!changed)
+	return;
+
+    /* Rats can go to any process, not just neighboring ones */
+    for (ri = 0; ri < s->local_rat_count; ri++) {
+	int nid = s->rat_position[ri];
+	if (!local_node(g, nid)) {
+	    export_rat(s, ri, nid);
+	    s->rat_position[ri] = -1;
+	}
+    }
+    int send_count[nzone], send_start[nzone], recv_count[nzone], recv_start[nzone];
+    int nsend = 0;
+    for (z = 0; z < nzone; z++) {
+	send_count[z] = s->export_rat_buffer[z].count;
+	send_start[z] = nsend;
+	nsend += send_count[z];
+    }
+    MPI_Alltoall(send_count, 1, MPI_INT, recv_count, 1, MPI_INT, MPI_COMM_WORLD);
+    int nrecv = 0;
+    for (z = 0; z < nzone; z++) {
+	recv_start[z] = nrecv;
+	nrecv += recv_count[z];
+    }
+    int *send_data = int_alloc(nsend > 0 ? nsend : 1);
+    if (send_data == NULL) {
+	outmsg("Couldn't allocate space for migrating rats.  Exiting");
+	MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (z = 0; z < nzone; z++) {
+	memcpy(send_data + send_start[z], s->export_rat_buffer[z].data, send_count[z] * sizeof(int));
+	s->export_rat_buffer[z].count = 0;
+    }
+    ibuf_t *ibuf = &s->import_rat_buffer;
+    ibuf_reserve(ibuf, nrecv > 0 ? nrecv : 1);
+    MPI_Alltoallv(send_data, send_count, send_start, MPI_INT,
+		  ibuf->data, recv_count, recv_start, MPI_INT, MPI_COMM_WORLD);
+    ibuf->count = nrecv;
+    free(send_data);
+    merge_rats(s);
+
+    clear_zone(g);
+    if (!setup_zone(g, this_zone) || !reset_zone_buffers(s)) {
+	outmsg("Couldn't set up reassigned zone.  Exiting");
+	MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    take_census(s);
+    exchange_counts(s);
+    compute_all_weights(s);
+    exchange_weights(s);
+    if (s->stats)
+	init_stats(s);
+}
+#endif
+
+/*
+  Reorder local rats so that each batch's rats are grouped by node.
+  Uses two counting-sort passes: first by node, and then (stably) by batch.
+  Since moves within a batch depend only on the weights at the start of the batch,
+  the order of rats within a batch does not affect the results.
+ */
+static void group_rats(state_t *s) {
+    graph_t *g = s->g;
+    int nlocal = s->local_rat_count;
+    int bsize = s->batch_size;
+    int nbatch = (s->nrat + bsize - 1) / bsize;
+    int ri, i;
+    if (s->group_bucket == NULL)
+	s->group_bucket = int_alloc((g->nnode > nbatch ? g->nnode : nbatch) + 1);
+    /* Arrays get swapped with rat data, and so must match its capacity */
+    if (s->group_capacity < s->local_rat_capacity) {
+	free(s->group_order);
+	free(s->group_scratch);
+	free(s->group_seed_scratch);
+	s->group_capacity = s->local_rat_capacity;
+	s->group_order = int_alloc(s->group_capacity);
+	s->group_scratch = int_alloc(s->group_capacity);
+	s->group_seed_scratch = rt_alloc(s->group_capacity);
+	if (s->group_order == NULL || s->group_scratch == NULL || s->group_seed_scratch == NULL) {
+	    outmsg("Couldn't allocate space for grouping rats.  Exiting");
+	    exit(1);
+	}
+    }
+    if (s->group_bucket == NULL) {
+	outmsg("Couldn't allocate space for grouping rats.  Exiting");
+	exit(1);
+    }
+    int *bucket = s->group_bucket;
+    int *by_node = s->group_scratch;
+    int *order = s->group_order;
+
+    /* Sort by node */
+    memset(bucket, 0, (g->nnode + 1) * sizeof(int));
+    for (ri = 0; ri < nlocal; ri++)
+	bucket[s->rat_position[ri]+1]++;
+    for (i = 0; i < g->nnode; i++)
+	bucket[i+1] += bucket[i];
+    for (ri = 0; ri < nlocal; ri++)
+	by_node[bucket[s->rat_position[ri]]++] = ri;
+
+    /* Stable sort by batch */
+    memset(bucket, 0, (nbatch + 1) * sizeof(int));
+    for (ri = 0; ri < nlocal; ri++)
+	bucket[s->rat_id[ri]/bsize+1]++;
+    for (i = 0; i < nbatch; i++)
+	bucket[i+1] += bucket[i];
+    for (i = 0; i < nlocal; i++) {
+	ri = by_node[i];
+	order[bucket[s->rat_id[ri]/bsize]++] = ri;
+    }
+
+    /* Permute rat data */
+    int *itmp = s->group_scratch;
+    for (i = 0; i < nlocal; i++)
+	itmp[i] = s->rat_id[order[i]];
+    s->group_scratch = s->rat_id;
+    s->rat_id = itmp;
+    itmp = s->group_scratch;
+    for (i = 0; i < nlocal; i++)
+	itmp[i] = s->rat_position[order[i]];
+    s->group_scratch = s->rat_position;
+    s->rat_position = itmp;
+    random_t *stmp = s->group_seed_scratch;
+    for (i = 0; i < nlocal; i++)
+	stmp[i] = s->rat_seed[order[i]];
+    s->group_seed_scratch = s->rat_seed;
+    s->rat_seed = stmp;
+}
+
+/*
+  Move local rats with indices cstart .. cend-1.
+  Each move depends only on the weights at the start of the batch,
+  and so moves can be computed in parallel.  Counts are then updated
+  in rat order.
+ */
+static inline void move_rats(state_t *s, int cstart, int cend) {
     int ri;
-    find_all_sums(s);
-    for (ri = 0; ri < bcount; ri++) {
-	int rid = ri+bstart;
-	int onid = s->rat_position[rid];
-	int nnid = fast_next_random_move(s, rid);
-	s->rat_position[rid] = nnid;
-	s->rat_count[onid] -= 1;
-	s->rat_count[nnid] += 1;
+    int *next_move = s->next_move - cstart;
+    double *random_value = s->random_value - cstart;
+    /* Draw random values for all rats in single pass */
+    next_random_batch(&s->rat_seed[cstart], s->random_value, cend - cstart);
+#pragma omp parallel for schedule(static) if (cend - cstart >= PARALLEL_THRESHOLD)
+    for (ri = cstart; ri < cend; ri++)
+	next_move[ri] = fast_next_random_move(s, ri, random_value[ri]);
+    for (ri = cstart; ri < cend; ri++) {
+	int onid = s->rat_position[ri];
+	int nnid = next_move[ri];
+	if (nnid == onid)
+	    continue;
+	set_node_count(s, onid, node_count(s, onid) - 1);
+	mark_count_changed(s, onid);
+	stat_count_changed(s, onid, -1);
+#if MPI
+	if (!local_node(s->g, nnid)) {
+	    export_rat(s, ri, nnid);
+	    s->rat_position[ri] = -1;
+	    continue;
+	}
+#endif
+	s->rat_position[ri] = nnid;
+	set_node_count(s, nnid, node_count(s, nnid) + 1);
+	mark_count_changed(s, nnid);
+	stat_count_changed(s, nnid, 1);
+    }
+}
+
+/* Process single batch */
+/*
+   Move local rats with indices lstart .. lstart+lcount-1.
+   With multiple zones:
+    * Export rats that move out of this zone
+    * Import rats that move into this zone
+    * Export counts for internal nodes adjacent to other zones
+    * Import counts for external nodes adjacent to this zone
+    * Compute weights for nodes in this zone
+    * Export weights for internal nodes adjacent to other zones
+    * Import weights for external nodes adjacent to this zone
+*/
+static inline void do_batch(state_t *s, int batch, int lstart, int lcount) {
+    int cstart;
+    uint64_t start = phase_start();
+    update_sums(s);
+    phase_end(PHASE_SUMS, start);
+    start = phase_start();
+    /*
+      Large batches are moved in chunks, bounding buffer space.
+      Count updates don't affect the moves of later rats in the batch.
+     */
+    for (cstart = lstart; cstart < lstart + lcount; cstart += MOVE_CHUNK) {
+	int cend = cstart + MOVE_CHUNK;
+	if (cend > lstart + lcount)
+	    cend = lstart + lcount;
+	move_rats(s, cstart, cend);
     }
+    phase_end(PHASE_MOVES, start);
+#if MPI
+    start = phase_start();
+    exchange_rats(s);
+    exchange_counts(s);
+    phase_end(PHASE_COMM, start);
+#endif
     /* Update weights */
-    compute_all_weights(s);
+    start = phase_start();
+    update_weights(s);
+    phase_end(PHASE_WEIGHTS, start);
+#if MPI
+    start = phase_start();
+    exchange_weights(s);
+    phase_end(PHASE_COMM, start);
+#endif
 }
 
 static void batch_step(state_t *s) {
@@ -172,14 +858,36 @@ static void batch_step(state_t *s) {
     int nrat = s->nrat;
     int bcount;
     int batch = 0;
+    /* Local rats are ordered by batch, and so each batch is a contiguous range */
+    int lstart = 0;
+    int lend;
+    uint64_t start;
+    if (s->group_rats) {
+	start = phase_start();
+	group_rats(s);
+	phase_end(PHASE_GROUP, start);
+    }
     while (bstart < nrat) {
 	bcount = nrat - bstart;
 	if (bcount > bsize)
 	    bcount = bsize;
-	do_batch(s, batch, bstart, bcount);
+#if MPI
+	lend = lstart;
+	while (lend < s->local_rat_count && s->rat_id[lend] < bstart + bcount)
+	    lend++;
+#else
+	lend = lstart + bcount;
+#endif
+	do_batch(s, batch, lstart, lend - lstart);
 	batch++;
 	bstart += bcount;
+	lstart = lend;
     }
+#if MPI
+    start = phase_start();
+    merge_rats(s);
+    phase_end(PHASE_COMM, start);
+#endif
 }
 
 double simulate(state_t *s, int count, update_t update_mode, int dinterval, bool display) {
@@ -187,20 +895,71 @@ double simulate(state_t *s, int count, update_t update_mode, int dinterval, bool
     /* Compute and show initial state */
     bool show_counts = true;
     double start = currentSeconds();
+    if (!set_update_mode(s, update_mode)) {
+#if MPI
+	MPI_Abort(MPI_COMM_WORLD, 1);
+#endif
+	exit(1);
+    }
+    uint64_t pstart = phase_start();
     take_census(s);
+    if (s->stats)
+	init_stats(s);
+    phase_end(PHASE_CENSUS, pstart);
+#if MPI
+    pstart = phase_start();
+    exchange_counts(s);
+    phase_end(PHASE_COMM, pstart);
+#endif
+    pstart = phase_start();
     compute_all_weights(s);
+    phase_end(PHASE_WEIGHTS, pstart);
+#if MPI
+    pstart = phase_start();
+    exchange_weights(s);
+    phase_end(PHASE_COMM, pstart);
+#endif
     if (display) {
+	pstart = phase_start();
 #if MPI
-	if (s->g->this_zone == 0)
-	    // Process 0 has a copy of the initial counts for all nodes.
+	if (s->g->this_zone == 0) {
+	    gather_node_state(s);
 	    show(s, show_counts);
+	} else
+	    send_node_state(s);
 #else
 	show(s, show_counts);
 #endif
+	phase_end(PHASE_OUTPUT, pstart);
     }
-    for (i = 0; i < count; i++) {
+    if (s->stats) {
+	pstart = phase_start();
+	show_stats(s, s->start_step);
+	phase_end(PHASE_OUTPUT, pstart);
+    }
+    /* After restart from checkpoint, steps continue from where it was written */
+    for (i = s->start_step; i < count; i++) {
 	batch_step(s);
+#if MPI
+	if (s->balance_interval > 0 && (i+1) % s->balance_interval == 0 && i+1 < count) {
+	    pstart = phase_start();
+	    rebalance_zones(s);
+	    phase_end(PHASE_COMM, pstart);
+	}
+#endif
+	if (s->checkpoint_name != NULL && s->checkpoint_interval > 0 &&
+	    (i+1) % s->checkpoint_interval == 0) {
+	    pstart = phase_start();
+	    if (!write_checkpoint(s, i+1)) {
+#if MPI
+		MPI_Abort(MPI_COMM_WORLD, 1);
+#endif
+		exit(1);
+	    }
+	    phase_end(PHASE_CHECKPOINT, pstart);
+	}
 	if (display) {
+	    pstart = phase_start();
 	    show_counts = (((i+1) % dinterval) == 0) || (i == count-1);
 #if MPI
 	    if (s->g->this_zone == 0) {
@@ -219,10 +978,15 @@ double simulate(state_t *s, int count, update_t update_mode, int dinterval, bool
 #else
 	    show(s, show_counts);
 #endif
+	    phase_end(PHASE_OUTPUT, pstart);
+	}
+	if (s->stats) {
+	    pstart = phase_start();
+	    show_stats(s, i+1);
+	    phase_end(PHASE_OUTPUT, pstart);
 	}
     }
     double delta = currentSeconds() - start;
-    done(s);
     return delta;
 }
 
@@ -1,3 +1,6 @@
+#include <sys/mman.h>
+#include <sys/stat.h>
+
 #include "crun.h"
 
 void outmsg(char *fmt, ...) {
@@ -26,13 +29,28 @@ double *double_alloc(size_t n) {
     return (double *) calloc(n, sizeof(double));
 }
 
+/* Allocate n weights and zero them out */
+weight_t *weight_alloc(size_t n) {
+    return (weight_t *) calloc(n, sizeof(weight_t));
+}
+
+/* Allocate n bool's and set them to false */
+bool *bool_alloc(size_t n) {
+    return (bool *) calloc(n, sizeof(bool));
+}
+
 /* Allocate n random number seeds and zero them out.  */
-static random_t *rt_alloc(size_t n) {
+random_t *rt_alloc(size_t n) {
     return (random_t *) calloc(n, sizeof(random_t));
 }
 
-/* Allocate simulation state */
-static state_t *new_rats(graph_t *g, int nrat, random_t global_seed) {
+/* Rats in a batch are moved in chunks of at most MOVE_CHUNK */
+static inline int move_buffer_size(state_t *s) {
+    return s->batch_size < MOVE_CHUNK ? s->batch_size : MOVE_CHUNK;
+}
+
+/* Allocate simulation state, with space for nlocal of the rats */
+static state_t *new_rats(graph_t *g, int nrat, int nlocal, random_t global_seed) {
     int nnode = g->nnode;
 
     state_t *s = malloc(sizeof(state_t));
@@ -44,7 +62,12 @@ static state_t *new_rats(graph_t *g, int nrat, random_t global_seed) {
     s->g = g;
     s->nrat = nrat;
     s->global_seed = global_seed;
-    s->load_factor = (double) nrat / nnode;
+    s->start_step = 0;
+    s->restored = false;
+    s->checkpoint_name = NULL;
+    s->checkpoint_interval = 0;
+    s->balance_interval = 0;
+    s->load_factor = (double) nrat / g->global_nnode;
 
     /* Compute batch size as max(BATCH_FRACTION * R, sqrt(R)) */
     int rpct = (int) (BATCH_FRACTION * nrat);
@@ -56,16 +79,66 @@ static state_t *new_rats(graph_t *g, int nrat, random_t global_seed) {
 
     // Allocate data structures
     bool ok = true;
-    s->rat_position = int_alloc(nrat);
+    int capacity = nlocal > 0 ? nlocal : 1;
+    s->local_rat_count = nlocal;
+    s->local_rat_capacity = capacity;
+    s->rat_id = int_alloc(capacity);
+    ok = ok && s->rat_id != NULL;
+    s->rat_position = int_alloc(capacity);
     ok = ok && s->rat_position != NULL;
-    s->rat_seed = rt_alloc(nrat);
+    s->rat_seed = rt_alloc(capacity);
     ok = ok && s->rat_seed != NULL;
-    s->rat_count = int_alloc(nnode);
-    ok = ok && s->rat_count != NULL;
+    /* Counts start narrow, and get widened if one doesn't fit */
+    s->short_count = calloc(nnode, sizeof(count_t));
+    ok = ok && s->short_count != NULL;
+    s->rat_count = NULL;
 
-    s->node_weight = double_alloc(nnode);
+    s->node_weight = weight_alloc(nnode);
     ok = ok && s->node_weight != NULL;
 
+    s->next_move = int_alloc(move_buffer_size(s));
+    ok = ok && s->next_move != NULL;
+
+    s->random_value = double_alloc(move_buffer_size(s));
+    ok = ok && s->random_value != NULL;
+
+    s->group_rats = false;
+    s->group_capacity = 0;
+    s->group_order = NULL;
+    s->group_scratch = NULL;
+    s->group_seed_scratch = NULL;
+    s->group_bucket = NULL;
+
+    s->stats = false;
+    s->stat_file = NULL;
+    s->stat_count_hist = NULL;
+    s->stat_hist_capacity = 0;
+    s->stat_zone_total = NULL;
+
+    s->output_mode = OUTPUT_TEXT;
+    s->out_file = stdout;
+    s->output_buffer = NULL;
+    s->last_count = NULL;
+
+    ok = ok && init_weight_tables(s);
+
+    s->count_changed_list = int_alloc(nnode);
+    ok = ok && s->count_changed_list != NULL;
+    s->count_changed_count = 0;
+    s->count_changed = bool_alloc(nnode);
+    ok = ok && s->count_changed != NULL;
+    s->weight_changed_list = int_alloc(nnode);
+    ok = ok && s->weight_changed_list != NULL;
+    s->weight_changed_count = 0;
+    s->weight_changed = bool_alloc(nnode);
+    ok = ok && s->weight_changed != NULL;
+    s->all_weights_changed = true;
+    s->sum_changed_list = int_alloc(nnode);
+    ok = ok && s->sum_changed_list != NULL;
+    s->sum_changed = bool_alloc(nnode);
+    ok = ok && s->sum_changed != NULL;
+    s->lazy_sums = false;
+
     s->sum_weight = NULL;  // Allocated only when sure running in synchronous or batch mode
     s->neighbor_accum_weight = NULL; // Only when running in synchronous or batch mode
 
@@ -73,95 +146,727 @@ static state_t *new_rats(graph_t *g, int nrat, random_t global_seed) {
 	outmsg("Couldn't allocate space for %d rats", nrat);
 	return NULL;
     }
+    int r;
+    for (r = 0; r < nlocal; r++)
+	s->rat_id[r] = r;
     return s;
 }
 
-/* Set seed values for the rats.  Maybe you could use multiple threads ... */
+/* Set seed values for the rats */
 static void seed_rats(state_t *s) {
     random_t global_seed = s->global_seed;
-    int nrat = s->nrat;
+    int nrat = s->local_rat_count;
     int r;
+#pragma omp parallel for schedule(static) if (nrat >= PARALLEL_THRESHOLD)
     for (r = 0; r < nrat; r++) {
 	random_t seeds[2];
 	seeds[0] = global_seed;
-	seeds[1] = r;
+	seeds[1] = rat_number(s, r);
 	reseed(&s->rat_seed[r], seeds, 2);
 #if DEBUG
-	if (r == TAG)
-	    outmsg("Rat %d.  Setting seed to %u\n", r, (unsigned) s->rat_seed[r]);
+	if (rat_number(s, r) == TAG)
+	    outmsg("Rat %d.  Setting seed to %u\n", rat_number(s, r), (unsigned) s->rat_seed[r]);
 #endif
     }
 }
 
-/* See whether line of text is a comment */
-static inline bool is_comment(char *s) {
-    int i;
-    int n = strlen(s);
-    for (i = 0; i < n; i++) {
-	char c = s[i];
-	if (!isspace(c))
-	    return c == '#';
-    }
-    return false;
+/* Check whether file starts with magic identifier of binary file.  Rewind if not */
+bool binary_file(FILE *infile, char *magic) {
+    char buf[4];
+    bool match = fread(buf, 1, sizeof(buf), infile) == sizeof(buf) &&
+	memcmp(buf, magic, sizeof(buf)) == 0;
+    rewind(infile);
+    return match;
 }
 
-/* Read in rat file */
-state_t *read_rats(graph_t *g, FILE *infile, random_t global_seed) {
-    char linebuf[MAXLINE];
-    int r, nnode, nid, nrat;
+/*
+  Map entire file into memory.  Return NULL if fails.
+  Mapping is private, and so the contents can be modified without affecting the file
+ */
+void *map_file(FILE *infile, size_t *lengthp) {
+    struct stat st;
+    int fd = fileno(infile);
+    if (fstat(fd, &st) != 0 || st.st_size == 0) {
+	outmsg("ERROR.  Couldn't determine file size\n");
+	return NULL;
+    }
+    void *base = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_PRIVATE, fd, 0);
+    if (base == MAP_FAILED) {
+	outmsg("ERROR.  Couldn't map file into memory\n");
+	return NULL;
+    }
+    *lengthp = st.st_size;
+    return base;
+}
 
-    // Read header information
-    while (fgets(linebuf, MAXLINE, infile) != NULL) {
-	if (!is_comment(linebuf))
+/* Read entire file into memory, as NUL-terminated string.  Works for pipes as well as files */
+static char *slurp_file(FILE *infile, size_t *lengthp) {
+    struct stat st;
+    size_t capacity = 1 << 20;
+    if (fstat(fileno(infile), &st) == 0 && S_ISREG(st.st_mode) && st.st_size > 0)
+	capacity = st.st_size + 1;
+    size_t length = 0;
+    char *text = malloc(capacity);
+    while (text != NULL) {
+	length += fread(text + length, 1, capacity - 1 - length, infile);
+	if (length < capacity - 1)
 	    break;
+	/* Filled buffer.  File may have grown, or be a pipe */
+	capacity *= 2;
+	char *ntext = realloc(text, capacity);
+	if (ntext == NULL)
+	    free(text);
+	text = ntext;
     }
-    if (sscanf(linebuf, "%d %d", &nnode, &nrat) != 2) {
-	outmsg("ERROR. Malformed rat file header (line 1)\n");
+    if (text == NULL) {
+	outmsg("ERROR.  Couldn't allocate space to read file\n");
+	return NULL;
+    }
+    if (ferror(infile)) {
+	outmsg("ERROR.  Couldn't read file\n");
+	free(text);
+	return NULL;
+    }
+    text[length] = '\0';
+    *lengthp = length;
+    return text;
+}
+
+/* Count records and lines in chunk c */
+static void count_chunk(text_t *t, int c, int *nrecordp, int *nlinep) {
+    char *pos;
+    char *end = t->chunk_start[c+1];
+    int nrecord = 0;
+    int nline = 0;
+    for (pos = t->chunk_start[c]; pos < end; pos = next_line(pos)) {
+	nline++;
+	if (is_record(pos))
+	    nrecord++;
+    }
+    *nrecordp = nrecord;
+    *nlinep = nline;
+}
+
+bool read_text(FILE *infile, text_t *t) {
+    size_t length;
+    memset(t, 0, sizeof(text_t));
+    t->text = slurp_file(infile, &length);
+    if (t->text == NULL)
 	return false;
+    char *end = t->text + length;
+    /* Header is first record */
+    char *pos = t->text;
+    int lineno = 1;
+    while (pos < end && !is_record(pos)) {
+	pos = next_line(pos);
+	lineno++;
+    }
+    if (pos == end) {
+	outmsg("ERROR.  File contains no data\n");
+	free_text(t);
+	return false;
+    }
+    char *body = next_line(pos);
+    size_t hlen = body - pos < MAXLINE ? body - pos : MAXLINE - 1;
+    memcpy(t->header, pos, hlen);
+    t->header[hlen] = '\0';
+    lineno++;
+
+    /* Divide rest of file into chunks of whole lines, several per thread for balance */
+    int nchunk = 1;
+#ifdef _OPENMP
+    nchunk = 4 * omp_get_max_threads();
+#endif
+    size_t blength = end - body;
+    if (blength / TEXT_CHUNK + 1 < nchunk)
+	nchunk = blength / TEXT_CHUNK + 1;
+    t->nchunk = nchunk;
+    t->chunk_start = calloc(nchunk + 1, sizeof(char *));
+    t->chunk_record = int_alloc(nchunk + 1);
+    t->chunk_line = int_alloc(nchunk);
+    t->chunk_error = calloc(nchunk, MAXLINE);
+    if (t->chunk_start == NULL || t->chunk_record == NULL || t->chunk_line == NULL || t->chunk_error == NULL) {
+	outmsg("ERROR.  Couldn't allocate space to parse file\n");
+	free_text(t);
+	return false;
+    }
+    int c;
+    t->chunk_start[0] = body;
+    for (c = 1; c < nchunk; c++) {
+	pos = body + blength / nchunk * c;
+	if (pos < t->chunk_start[c-1])
+	    pos = t->chunk_start[c-1];
+	else if (pos[-1] != '\n')
+	    pos = next_line(pos);
+	t->chunk_start[c] = pos;
+    }
+    t->chunk_start[nchunk] = end;
+
+    /* Count records and lines in each chunk, and then number them with prefix sums */
+    int nrecord[nchunk];
+    int nline[nchunk];
+#pragma omp parallel for schedule(dynamic)
+    for (c = 0; c < nchunk; c++)
+	count_chunk(t, c, &nrecord[c], &nline[c]);
+    t->chunk_record[0] = 0;
+    for (c = 0; c < nchunk; c++) {
+	t->chunk_record[c+1] = t->chunk_record[c] + nrecord[c];
+	t->chunk_line[c] = lineno;
+	lineno += nline[c];
+    }
+    return true;
+}
+
+void free_text(text_t *t) {
+    free(t->text);
+    free(t->chunk_start);
+    free(t->chunk_record);
+    free(t->chunk_line);
+    free(t->chunk_error);
+    memset(t, 0, sizeof(text_t));
+}
+
+bool text_ok(text_t *t) {
+    int c;
+    for (c = 0; c < t->nchunk; c++) {
+	char *msg = text_error(t, c);
+	if (msg[0] != '\0') {
+	    outmsg("%s\n", msg);
+	    return false;
+	}
+    }
+    return true;
+}
+
+/* Read in binary rat file */
+static state_t *map_rats(graph_t *g, FILE *infile, random_t global_seed) {
+    size_t length;
+    char *base = map_file(infile, &length);
+    fclose(infile);
+    if (base == NULL)
+	return NULL;
+    if (length < sizeof(rat_header_t)) {
+	outmsg("ERROR.  Binary rat file has invalid size\n");
+	munmap(base, length);
+	return NULL;
+    }
+    rat_header_t *header = (rat_header_t *) base;
+    int nnode = header->nnode;
+    int nrat = header->nrat;
+    if (nrat < 0 || length != sizeof(rat_header_t) + (size_t) nrat * sizeof(int32_t)) {
+	outmsg("ERROR.  Binary rat file has invalid size\n");
+	munmap(base, length);
+	return NULL;
     }
     if (nnode != g->nnode) {
 	outmsg("Graph contains %d nodes, but rat file has %d\n", g->nnode, nnode);
+	munmap(base, length);
 	return NULL;
     }
-    
-    state_t *s = new_rats(g, nrat, global_seed);
+    state_t *s = new_rats(g, nrat, nrat, global_seed);
+    if (s == NULL) {
+	munmap(base, length);
+	return NULL;
+    }
+    int32_t *position = (int32_t *) (base + sizeof(rat_header_t));
+    int r;
+    for (r = 0; r < nrat; r++) {
+	int nid = position[r];
+	if (nid < 0 || nid >= nnode) {
+	    outmsg("ERROR.  Rat %d.  Invalid node number %d\n", r, nid);
+	    munmap(base, length);
+	    return NULL;
+	}
+	s->rat_position[r] = nid;
+    }
+    munmap(base, length);
+    return s;
+}
 
+/* Store initial rat positions in binary format */
+bool write_rats_binary(state_t *s, FILE *outfile) {
+    rat_header_t header;
+    memcpy(header.magic, RAT_MAGIC, sizeof(header.magic));
+    header.nnode = s->g->nnode;
+    header.nrat = s->nrat;
+    header.pad = 0;
+    bool ok = fwrite(&header, sizeof(header), 1, outfile) == 1;
+    ok = ok && fwrite(s->rat_position, sizeof(int), s->nrat, outfile) == s->nrat;
+    if (!ok)
+	outmsg("ERROR.  Couldn't write binary rat file\n");
+    return ok;
+}
 
-    for (r = 0; r < nrat; r++) {
-	while (fgets(linebuf, MAXLINE, infile) != NULL) {
-	    if (!is_comment(linebuf))
-		break;
+/* Name of checkpoint file for shard.  A single shard uses name itself */
+static void checkpoint_file_name(char *buf, char *name, int shard, int nshard) {
+    if (nshard == 1)
+	snprintf(buf, MAXLINE, "%s", name);
+    else
+	snprintf(buf, MAXLINE, "%s.%d", name, shard);
+}
+
+/*
+  Write checkpoint via temporary file and then rename it,
+  so that a failure while writing leaves the previous checkpoint intact.
+ */
+bool write_checkpoint(state_t *s, int step) {
+    graph_t *g = s->g;
+    char fname[MAXLINE], tname[MAXLINE+4];
+    checkpoint_file_name(fname, s->checkpoint_name, g->this_zone, g->nzone);
+    snprintf(tname, sizeof(tname), "%s.tmp", fname);
+    FILE *outfile = fopen(tname, "w");
+    if (outfile == NULL) {
+	outmsg("Couldn't open checkpoint file %s\n", tname);
+	return false;
+    }
+    checkpoint_header_t header;
+    memcpy(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic));
+    header.nnode = g->global_nnode;
+    header.nrat = s->nrat;
+    header.step = step;
+    header.nshard = g->nzone;
+    header.shard = g->this_zone;
+    header.count = s->local_rat_count;
+    header.global_seed = s->global_seed;
+    size_t count = s->local_rat_count;
+    bool ok = fwrite(&header, sizeof(header), 1, outfile) == 1;
+    if (s->rat_id != NULL) {
+	ok = ok && fwrite(s->rat_id, sizeof(int), count, outfile) == count;
+    } else {
+	int *id = int_alloc(count);
+	size_t i;
+	ok = ok && id != NULL;
+	for (i = 0; ok && i < count; i++)
+	    id[i] = i;
+	ok = ok && fwrite(id, sizeof(int), count, outfile) == count;
+	free(id);
+    }
+    if (g->file_nid == NULL) {
+	ok = ok && fwrite(s->rat_position, sizeof(int), count, outfile) == count;
+    } else {
+	/* Positions are stored with node numbers from graph file */
+	int *position = int_alloc(count);
+	size_t i;
+	ok = ok && position != NULL;
+	for (i = 0; ok && i < count; i++)
+	    position[i] = g->file_nid[s->rat_position[i]];
+	ok = ok && fwrite(position, sizeof(int), count, outfile) == count;
+	free(position);
+    }
+    ok = ok && fwrite(s->rat_seed, sizeof(random_t), count, outfile) == count;
+    ok = fclose(outfile) == 0 && ok;
+    ok = ok && rename(tname, fname) == 0;
+    if (!ok)
+	outmsg("ERROR.  Couldn't write checkpoint file %s\n", fname);
+    return ok;
+}
+
+/*
+  Read one shard of checkpoint into state.
+  For first shard, creates state and array seen, marking which rats have been read
+ */
+static state_t *read_checkpoint_shard(graph_t *g, char *fname, state_t *s, checkpoint_header_t *first,
+				      bool **seenp) {
+    FILE *infile = fopen(fname, "r");
+    if (infile == NULL) {
+	outmsg("Couldn't open checkpoint file %s\n", fname);
+	return NULL;
+    }
+    checkpoint_header_t header;
+    if (fread(&header, sizeof(header), 1, infile) != 1 ||
+	memcmp(header.magic, CHECKPOINT_MAGIC, sizeof(header.magic)) != 0) {
+	outmsg("ERROR.  %s is not a checkpoint file\n", fname);
+	fclose(infile);
+	return NULL;
+    }
+    if (header.nnode != g->nnode) {
+	outmsg("Graph contains %d nodes, but checkpoint has %d\n", g->nnode, header.nnode);
+	fclose(infile);
+	return NULL;
+    }
+    if (header.nrat < 0 || header.count < 0 || header.count > header.nrat || header.nshard < 1) {
+	outmsg("ERROR.  Checkpoint file %s has invalid header\n", fname);
+	fclose(infile);
+	return NULL;
+    }
+    if (s == NULL) {
+	*first = header;
+	s = new_rats(g, header.nrat, header.nrat, header.global_seed);
+	*seenp = bool_alloc(header.nrat > 0 ? header.nrat : 1);
+	if (s == NULL || *seenp == NULL) {
+	    fclose(infile);
+	    return NULL;
 	}
-	if (sscanf(linebuf, "%d", &nid) != 1) {
-	    outmsg("Error in rat file.  Line %d\n", r+2);
-	    return false;
+    } else if (header.nrat != first->nrat || header.step != first->step ||
+	       header.nshard != first->nshard || header.global_seed != first->global_seed) {
+	outmsg("ERROR.  Checkpoint file %s does not match other shards\n", fname);
+	fclose(infile);
+	return NULL;
+    }
+    bool *seen = *seenp;
+    size_t count = header.count;
+    int *id = int_alloc(count > 0 ? count : 1);
+    int *position = int_alloc(count > 0 ? count : 1);
+    random_t *seed = rt_alloc(count > 0 ? count : 1);
+    bool ok = id != NULL && position != NULL && seed != NULL;
+    ok = ok && fread(id, sizeof(int), count, infile) == count;
+    ok = ok && fread(position, sizeof(int), count, infile) == count;
+    ok = ok && fread(seed, sizeof(random_t), count, infile) == count;
+    fclose(infile);
+    if (!ok)
+	outmsg("ERROR.  Couldn't read checkpoint file %s\n", fname);
+    size_t i;
+    for (i = 0; ok && i < count; i++) {
+	int r = id[i];
+	if (r < 0 || r >= s->nrat || seen[r]) {
+	    outmsg("ERROR.  Checkpoint file %s has invalid or duplicate rat %d\n", fname, r);
+	    ok = false;
+	} else if (position[i] < 0 || position[i] >= g->nnode) {
+	    outmsg("ERROR.  Checkpoint file %s.  Rat %d has invalid node number %d\n", fname, r, position[i]);
+	    ok = false;
+	} else {
+	    seen[r] = true;
+	    s->rat_position[r] = graph_node(g, position[i]);
+	    s->rat_seed[r] = seed[i];
+	}
+    }
+    free(id);
+    free(position);
+    free(seed);
+    return ok ? s : NULL;
+}
+
+state_t *read_checkpoint(graph_t *g, char *name) {
+    char fname[MAXLINE];
+    checkpoint_header_t first = {{0}};
+    state_t *s = NULL;
+    bool *seen = NULL;
+    /* Either single file, or shards name.0, name.1, ... */
+    FILE *test = fopen(name, "r");
+    bool single = test != NULL;
+    if (test != NULL)
+	fclose(test);
+    int shard = 0;
+    do {
+	checkpoint_file_name(fname, name, shard, single ? 1 : 2);
+	s = read_checkpoint_shard(g, fname, s, &first, &seen);
+	if (s == NULL) {
+	    free(seen);
+	    return NULL;
+	}
+	shard++;
+    } while (!single && shard < first.nshard);
+    int r;
+    for (r = 0; r < s->nrat; r++) {
+	if (!seen[r]) {
+	    outmsg("ERROR.  Checkpoint %s missing rat %d\n", name, r);
+	    free(seen);
+	    return NULL;
+	}
+    }
+    free(seen);
+    s->start_step = first.step;
+    s->restored = true;
+    outmsg("Restored %d rats at step %d from checkpoint %s\n", s->nrat, s->start_step, name);
+    return s;
+}
+
+/* Parse rat positions in chunk c of text */
+static void parse_rat_chunk(text_t *t, int c, int nnode, int nrat, int *position) {
+    char *pos;
+    char *end = t->chunk_start[c+1];
+    int r = t->chunk_record[c];
+    int lineno = t->chunk_line[c];
+    for (pos = t->chunk_start[c]; pos < end && r < nrat; pos = next_line(pos), lineno++) {
+	if (!is_record(pos))
+	    continue;
+	int nid;
+	if (scan_int(pos, &nid) == NULL) {
+	    snprintf(text_error(t, c), MAXLINE, "Error in rat file.  Line %d", lineno);
+	    return;
 	}
 	if (nid < 0 || nid >= nnode) {
-	    outmsg("ERROR.  Line %d.  Invalid node number %d\n", r+2, nid);
-	    return false;
+	    snprintf(text_error(t, c), MAXLINE, "ERROR.  Line %d.  Invalid node number %d", lineno, nid);
+	    return;
 	}
-	s->rat_position[r] = nid;
+	position[r++] = nid;
     }
+}
+
+/* Read in text rat file.  Chunks of the file are parsed in parallel */
+static state_t *parse_rats(graph_t *g, FILE *infile, random_t global_seed) {
+    text_t t;
+    int nnode, nrat;
+    bool ok = read_text(infile, &t);
     fclose(infile);
+    if (!ok)
+	return NULL;
+    if (sscanf(t.header, "%d %d", &nnode, &nrat) != 2 || nrat < 0) {
+	outmsg("ERROR. Malformed rat file header (line 1)\n");
+	free_text(&t);
+	return NULL;
+    }
+    if (nnode != g->nnode) {
+	outmsg("Graph contains %d nodes, but rat file has %d\n", g->nnode, nnode);
+	free_text(&t);
+	return NULL;
+    }
+    if (t.chunk_record[t.nchunk] < nrat) {
+	outmsg("ERROR.  Rat file has %d rats.  Expecting %d\n", t.chunk_record[t.nchunk], nrat);
+	free_text(&t);
+	return NULL;
+    }
+    
+    state_t *s = new_rats(g, nrat, nrat, global_seed);
+    if (s == NULL) {
+	free_text(&t);
+	return NULL;
+    }
+    int c;
+#pragma omp parallel for schedule(dynamic)
+    for (c = 0; c < t.nchunk; c++)
+	parse_rat_chunk(&t, c, nnode, nrat, s->rat_position);
+    ok = text_ok(&t);
+    free_text(&t);
+    return ok ? s : NULL;
+}
 
+/* Read in rat file, either text or binary */
+state_t *read_rats(graph_t *g, FILE *infile, random_t global_seed) {
+    state_t *s;
+    if (binary_file(infile, RAT_MAGIC))
+	s = map_rats(g, infile, global_seed);
+    else
+	s = parse_rats(g, infile, global_seed);
+    if (s == NULL)
+	return NULL;
+    if (g->graph_nid != NULL) {
+	int r;
+	for (r = 0; r < s->nrat; r++)
+	    s->rat_position[r] = g->graph_nid[s->rat_position[r]];
+    }
+
+#if !MPI
+    /* With multiple zones, rats get seeded once distributed */
     seed_rats(s);
-    outmsg("Loaded %d rats\n", nrat);
+#endif
+    outmsg("Loaded %d rats\n", s->nrat);
 #if DEBUG
     outmsg("Load factor = %f\n", s->load_factor);
 #endif
     return s;
 }
 
-/* print state of nodes */
+#if !MPI
+state_t *clone_rats(state_t *s, random_t global_seed) {
+    state_t *ns = new_rats(s->g, s->nrat, s->nrat, global_seed);
+    if (ns == NULL)
+	return NULL;
+    memcpy(ns->rat_position, s->rat_position, s->nrat * sizeof(int));
+    seed_rats(ns);
+    return ns;
+}
+
+void free_rats(state_t *s) {
+    free(s->rat_id);
+    free(s->rat_position);
+    free(s->rat_seed);
+    free(s->short_count);
+    free(s->rat_count);
+    free(s->node_weight);
+    free(s->count_changed_list);
+    free(s->count_changed);
+    free(s->weight_changed_list);
+    free(s->weight_changed);
+    free(s->sum_changed_list);
+    free(s->sum_changed);
+    free(s->next_move);
+    free(s->random_value);
+    free(s->group_order);
+    free(s->group_scratch);
+    free(s->group_seed_scratch);
+    free(s->group_bucket);
+    free(s->stat_count_hist);
+    free(s->stat_zone_total);
+    free(s->output_buffer);
+    free(s->last_count);
+    free(s->imbalance_table);
+    free(s->weight_cache);
+    free(s->hub_imbalance);
+    free(s->hub_imbalance_rcount);
+    free(s->hub_imbalance_start);
+    free(s->hub_imbalance_lcount);
+    free(s->sum_weight);
+    free(s->neighbor_accum_weight);
+    free(s);
+}
+#endif
+
+/* Space reserved at start of output buffer for header line */
+#define HEADER_SPACE 64
+
+/* Store decimal representation of nonnegative value, followed by newline */
+static inline char *format_count(char *pos, int val) {
+    char digits[12];
+    int n = 0;
+    do {
+	digits[n++] = '0' + val % 10;
+	val /= 10;
+    } while (val > 0);
+    while (n > 0)
+	*pos++ = digits[--n];
+    *pos++ = '\n';
+    return pos;
+}
+
+/*
+  print state of nodes.
+  Entire step is formatted in buffer and written with single call.
+ */
 void show(state_t *s, bool show_counts) {
     int nid;
     graph_t *g = s->g;
-    printf("STEP %d %d\n", g->nnode, s->nrat);
-    if (show_counts) {
-	    for (nid = 0; nid < g->nnode; nid++)
-		printf("%d\n", s->rat_count[nid]);
+    int nnode = g->nnode;
+    if (s->output_buffer == NULL) {
+	/* Enough for text, binary, or (node, count) pairs */
+	s->output_buffer = malloc(HEADER_SPACE + 12 * (size_t) nnode + 8);
+	s->last_count = int_alloc(nnode);
+	if (s->output_buffer == NULL || s->last_count == NULL) {
+	    outmsg("Couldn't allocate space for output buffer.  Exiting");
+	    exit(1);
+	}
+    }
+    /* Body starts after space reserved for header */
+    char *body = s->output_buffer + HEADER_SPACE;
+    char *pos = body;
+    char header[HEADER_SPACE];
+    if (!show_counts) {
+	sprintf(header, "STEP %d %d\n", nnode, s->nrat);
+    } else if (s->output_mode == OUTPUT_TEXT) {
+	sprintf(header, "STEP %d %d\n", nnode, s->nrat);
+	for (nid = 0; nid < nnode; nid++)
+	    pos = format_count(pos, node_count(s, graph_node(g, nid)));
+    } else if (s->output_mode == OUTPUT_BINARY) {
+	sprintf(header, "BSTEP %d %d\n", nnode, s->nrat);
+	if (g->graph_nid == NULL && s->rat_count != NULL) {
+	    memcpy(pos, s->rat_count, nnode * sizeof(int));
+	} else {
+	    int *count = (int *) pos;
+	    for (nid = 0; nid < nnode; nid++)
+		count[nid] = node_count(s, graph_node(g, nid));
+	}
+	pos += nnode * sizeof(int);
+    } else {
+	/* List (node, count) pairs for nodes whose counts changed since last shown */
+	int *pair = (int *) pos;
+	int nchange = 0;
+	/* Node numbers as in graph file */
+	for (nid = 0; nid < nnode; nid++) {
+	    int count = node_count(s, graph_node(g, nid));
+	    if (count != s->last_count[nid]) {
+		pair[2*nchange] = nid;
+		pair[2*nchange+1] = count;
+		nchange++;
+		s->last_count[nid] = count;
+	    }
+	}
+	pos += 2 * nchange * sizeof(int);
+	sprintf(header, "DSTEP %d %d %d\n", nnode, s->nrat, nchange);
+    }
+    memcpy(pos, "END\n", 4);
+    pos += 4;
+    size_t hlen = strlen(header);
+    char *start = body - hlen;
+    memcpy(start, header, hlen);
+    fwrite(start, 1, pos - start, s->out_file);
+}
+
+/*
+  Rat Ids take a third of the space for rats.  With a single zone and
+  rats kept in Id order, they are implied by the rat's index.
+  With MPI, or when grouping rats, they must be kept
+ */
+bool compact_rats(state_t *s) {
+#if MPI
+    return false;
+#else
+    if (s->group_rats)
+	return false;
+    free(s->rat_id);
+    s->rat_id = NULL;
+    return true;
+#endif
+}
+
+/* Some count no longer fits in count_t.  Counts are kept as int from now on */
+void widen_counts(state_t *s) {
+    int nnode = s->g->nnode;
+    int nid;
+    s->rat_count = int_alloc(nnode);
+    if (s->rat_count == NULL) {
+	outmsg("Couldn't allocate space for rat counts.  Exiting");
+#if MPI
+	MPI_Abort(MPI_COMM_WORLD, 1);
+#endif
+	exit(1);
     }
-    printf("END\n");
+    for (nid = 0; nid < nnode; nid++)
+	s->rat_count[nid] = s->short_count[nid];
+    free(s->short_count);
+    s->short_count = NULL;
+}
+
+/*
+  Estimate memory used by this process for graph and simulation state,
+  from the sizes of the main arrays.
+  With multiple processes, prints maximum over processes.
+ */
+void report_memory(state_t *s) {
+    graph_t *g = s->g;
+    size_t nnode = g->nnode;
+    size_t nentry = (size_t) g->nnode + g->nedge;
+    size_t nrat = s->local_rat_capacity;
+    size_t wsize = sizeof(weight_t);
+    /* Graph, rats, nodes, edges, other */
+    double bytes[5];
+    bytes[0] = (nnode + 1 + nentry) * sizeof(int);
+    if (g->zone_id != NULL)
+	bytes[0] += nnode * sizeof(int);
+    if (g->fzone_id != NULL)
+	bytes[0] += nnode * sizeof(int);
+    if (g->file_nid != NULL)
+	bytes[0] += nnode * sizeof(int);
+    if (g->graph_nid != NULL)
+	bytes[0] += (size_t) g->global_nnode * sizeof(int);
+    if (g->global_nid != NULL)
+	bytes[0] += nnode * sizeof(int);
+    size_t per_rat = (s->rat_id == NULL ? 0 : sizeof(int)) + sizeof(int) + sizeof(random_t);
+    if (s->group_rats)
+	per_rat += 2 * sizeof(int) + sizeof(random_t);
+    bytes[1] = nrat * per_rat;
+    /* Counts, weights, sums, change lists and flags, hub bookkeeping */
+    size_t csize = s->rat_count == NULL ? sizeof(count_t) : sizeof(int);
+    bytes[2] = nnode * (csize + 5 * sizeof(int) + 2 * wsize + 3 * sizeof(bool));
+    if (s->group_rats)
+	bytes[2] += (nnode + 1) * sizeof(int);
+    bytes[3] = nentry * wsize + (size_t) s->hub_imbalance_count * (sizeof(double) + sizeof(int));
+    int nthread = 1;
+#ifdef _OPENMP
+    nthread = omp_get_max_threads();
+#endif
+    bytes[4] = (double) s->imbalance_limit * s->imbalance_limit * sizeof(double) +
+	(double) nthread * WEIGHT_CACHE_SIZE * sizeof(weight_cache_t) +
+	(double) move_buffer_size(s) * (sizeof(int) + sizeof(double));
+#if MPI
+    MPI_Reduce(g->this_zone == 0 ? MPI_IN_PLACE : bytes, bytes, 5, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    if (g->this_zone != 0)
+	return;
+#endif
+    double mb = 1024.0 * 1024.0;
+    double total = bytes[0] + bytes[1] + bytes[2] + bytes[3] + bytes[4];
+    outmsg("Memory%s: %.1f MB (graph %.1f, rats %.1f = %d bytes/rat, nodes %.1f, edges %.1f, other %.1f)\n",
+	   g->nzone > 1 ? " per process (max)" : "", total / mb, bytes[0] / mb, bytes[1] / mb,
+	   (int) per_rat, bytes[2] / mb, bytes[3] / mb, bytes[4] / mb);
 }
 
 /* Print final output */
@@ -170,15 +875,200 @@ void done(state_t *s) {
     if (s == NULL || s->g->this_zone != 0)
 	return;
 #endif
-    printf("DONE\n");
+    fprintf(s == NULL ? stdout : s->out_file, "DONE\n");
+}
+
+/*
+  Make count histogram large enough to hold count.  Counts are
+  bounded by R, but typically far smaller, so space is added on demand
+ */
+int *grow_stat_hist(state_t *s, int count) {
+    int capacity = 2 * (count + 1);
+    if (capacity < 64)
+	capacity = 64;
+    if (capacity > s->nrat + 1)
+	capacity = s->nrat + 1;
+    int *hist = realloc(s->stat_count_hist, capacity * sizeof(int));
+    if (hist == NULL)
+	return NULL;
+    memset(hist + s->stat_hist_capacity, 0, (capacity - s->stat_hist_capacity) * sizeof(int));
+    s->stat_count_hist = hist;
+    s->stat_hist_capacity = capacity;
+    return hist;
+}
+
+/*
+  Set up load statistics from current counts.  Afterwards, these get
+  updated incrementally as rats move, and so a step costs only the
+  number of moves, not the number of nodes.
+ */
+void init_stats(state_t *s) {
+    graph_t *g = s->g;
+    int nzone = g->nfzone > 0 ? g->nfzone : 1;
+    int i;
+    int maxcount = 0;
+    for (i = 0; i < g->local_node_count; i++)
+	if (node_count(s, g->local_node_list[i]) > maxcount)
+	    maxcount = node_count(s, g->local_node_list[i]);
+    if (s->stat_zone_total == NULL)
+	s->stat_zone_total = int_alloc(nzone);
+    else
+	memset(s->stat_zone_total, 0, nzone * sizeof(int));
+    free(s->stat_count_hist);
+    s->stat_count_hist = NULL;
+    s->stat_hist_capacity = 0;
+    if (s->stat_zone_total == NULL || grow_stat_hist(s, maxcount) == NULL) {
+	outmsg("Couldn't allocate space for load statistics.  Exiting");
+#if MPI
+	MPI_Abort(MPI_COMM_WORLD, 1);
+#endif
+	exit(1);
+    }
+    s->stat_sum_sq = 0;
+    s->stat_min = s->nrat;
+    s->stat_max = 0;
+    for (i = 0; i < g->local_node_count; i++) {
+	int nid = g->local_node_list[i];
+	int count = node_count(s, nid);
+	s->stat_count_hist[count]++;
+	s->stat_sum_sq += (int64_t) count * count;
+	s->stat_zone_total[g->nfzone > 0 ? g->fzone_id[nid] : 0] += count;
+	if (count < s->stat_min)
+	    s->stat_min = count;
+	if (count > s->stat_max)
+	    s->stat_max = count;
+    }
+}
+
+/*
+  Print one line of load statistics for the step:
+  LOAD step min max mean stddev max/mean zones T0 .. TZ-1 hist H0 .. H7
+  Zone totals are per file zone.  The histogram counts nodes by load
+  (count / load factor): empty, (0,1/4), [1/4,1/2), [1/2,1), [1,2), [2,4), [4,8), >= 8
+ */
+void show_stats(state_t *s, int step) {
+    graph_t *g = s->g;
+    int nzone = g->nfzone > 0 ? g->nfzone : 1;
+    /* Node count, rat count, sum of squares, followed by histogram */
+    int64_t local[3+STAT_BINS];
+    int64_t global[3+STAT_BINS];
+    int extreme[2] = { -s->stat_min, s->stat_max };
+    int i, b;
+    memset(local, 0, sizeof(local));
+    local[0] = g->local_node_count;
+    local[1] = s->local_rat_count;
+    local[2] = s->stat_sum_sq;
+    if (g->local_node_count > 0) {
+	/* Walk nonempty range of count histogram, assigning counts to load bins */
+	int count = s->stat_min;
+	local[3] = count == 0 ? s->stat_count_hist[count++] : 0;
+	for (b = 1; b < STAT_BINS; b++) {
+	    double upper = b == STAT_BINS-1 ? (double) s->nrat + 1 : s->load_factor * ldexp(1.0, b-3);
+	    for (; count <= s->stat_max && count < upper; count++)
+		local[3+b] += s->stat_count_hist[count];
+	}
+    }
+#if MPI
+    int *zone_total = int_alloc(nzone);
+    MPI_Reduce(local, global, 3+STAT_BINS, MPI_INT64_T, MPI_SUM, 0, MPI_COMM_WORLD);
+    MPI_Reduce(g->this_zone == 0 ? MPI_IN_PLACE : extreme, extreme, 2, MPI_INT, MPI_MAX, 0, MPI_COMM_WORLD);
+    MPI_Reduce(s->stat_zone_total, zone_total, nzone, MPI_INT, MPI_SUM, 0, MPI_COMM_WORLD);
+    if (g->this_zone != 0) {
+	free(zone_total);
+	return;
+    }
+#else
+    int *zone_total = s->stat_zone_total;
+    memcpy(global, local, sizeof(local));
+#endif
+    double mean = (double) global[1] / global[0];
+    double var = (double) global[2] / global[0] - mean * mean;
+    double stddev = var > 0 ? sqrt(var) : 0.0;
+    FILE *f = s->stat_file;
+    fprintf(f, "LOAD %d %d %d %.3f %.3f %.3f zones", step, -extreme[0], extreme[1],
+	    mean, stddev, mean > 0 ? extreme[1] / mean : 0.0);
+    for (i = 0; i < nzone; i++)
+	fprintf(f, " %d", zone_total[i]);
+    fprintf(f, " hist");
+    for (b = 0; b < STAT_BINS; b++)
+	fprintf(f, " %" PRId64, global[3+b]);
+    fprintf(f, "\n");
+    fflush(f);
+#if MPI
+    free(zone_total);
+#endif
+}
+
+/* Profiling data */
+bool profiling = false;
+uint64_t phase_ticks[NPHASE];
+long phase_calls[NPHASE];
+static uint64_t profile_start_ticks = 0;
+
+char *phase_name[NPHASE] = {
+    "graph_load", "rat_load", "census", "group", "sums",
+    "moves", "weights", "comm", "output", "checkpoint" };
+
+void start_profile() {
+    profiling = true;
+    memset(phase_ticks, 0, sizeof(phase_ticks));
+    memset(phase_calls, 0, sizeof(phase_calls));
+    profile_start_ticks = currentTicks();
+}
+
+/*
+  Print breakdown of time by phase.
+  With multiple processes, reports maximum time and calls over all processes.
+  All processes must call this function.
+ */
+void show_profile(int process_count, int thread_count) {
+    if (!profiling)
+	return;
+    int p;
+    double spt = secondsPerTick();
+    double secs[NPHASE+1];
+    long calls[NPHASE];
+    for (p = 0; p < NPHASE; p++) {
+	secs[p] = phase_ticks[p] * spt;
+	calls[p] = phase_calls[p];
+    }
+    secs[NPHASE] = (currentTicks() - profile_start_ticks) * spt;
+#if MPI
+    int process_id;
+    MPI_Comm_rank(MPI_COMM_WORLD, &process_id);
+    MPI_Reduce(process_id == 0 ? MPI_IN_PLACE : secs, secs, NPHASE+1, MPI_DOUBLE, MPI_MAX, 0, MPI_COMM_WORLD);
+    MPI_Reduce(process_id == 0 ? MPI_IN_PLACE : calls, calls, NPHASE, MPI_LONG, MPI_MAX, 0, MPI_COMM_WORLD);
+    if (process_id != 0)
+	return;
+#endif
+    double total = secs[NPHASE];
+    double other = total;
+    fprintf(stderr, "%-12s %12s %12s %8s\n", "Phase", "Calls", "Seconds", "Percent");
+    for (p = 0; p < NPHASE; p++) {
+	fprintf(stderr, "%-12s %12ld %12.4f %7.1f%%\n", phase_name[p], calls[p], secs[p],
+		total > 0 ? 100.0 * secs[p] / total : 0.0);
+	other -= secs[p];
+    }
+    /* Time not in any phase.  Maximum times may come from different processes */
+    if (other < 0)
+	other = 0;
+    fprintf(stderr, "%-12s %12s %12.4f %7.1f%%\n", "other", "", other,
+	    total > 0 ? 100.0 * other / total : 0.0);
+    fprintf(stderr, "%-12s %12s %12.4f\n", "total", "", total);
+    fprintf(stderr, "{\"processes\": %d, \"threads\": %d, \"total_seconds\": %.6f, \"phases\": {",
+	    process_count, thread_count, total);
+    for (p = 0; p < NPHASE; p++)
+	fprintf(stderr, "%s\"%s\": {\"calls\": %ld, \"seconds\": %.6f}",
+		p == 0 ? "" : ", ", phase_name[p], calls[p], secs[p]);
+    fprintf(stderr, "}}\n");
 }
 
 void init_sum_weight(state_t *s) {
     graph_t *g = s->g;
     
     if (s->sum_weight == NULL) {
-	s->sum_weight = double_alloc(g->nnode);
-	s->neighbor_accum_weight = double_alloc(g->nnode + g->nedge);
+	s->sum_weight = weight_alloc(g->nnode);
+	s->neighbor_accum_weight = weight_alloc(g->nnode + g->nedge);
 	if (s->sum_weight == NULL || s->neighbor_accum_weight == NULL) {
 	    outmsg("Couldn't allocate space for sum_weight/neighbor_accum_weight.  Exiting");
 	    exit(1);
@@ -187,14 +1077,352 @@ void init_sum_weight(state_t *s) {
     }
 }
 
-//TODO Implement these functions
+/*
+  Synchronous mode moves all rats in a single batch,
+  and rat-order mode moves one rat per batch.
+ */
+bool set_update_mode(state_t *s, update_t update_mode) {
+    if (update_mode == UPDATE_SYNCHRONOUS)
+	s->batch_size = s->nrat;
+    else if (update_mode == UPDATE_RAT)
+	s->batch_size = 1;
+    s->lazy_sums = update_mode == UPDATE_RAT;
+    free(s->next_move);
+    free(s->random_value);
+    s->next_move = int_alloc(move_buffer_size(s));
+    s->random_value = double_alloc(move_buffer_size(s));
+    if (s->next_move == NULL || s->random_value == NULL) {
+	outmsg("Couldn't allocate space for batch of %d rats", s->batch_size);
+	return false;
+    }
+    return true;
+}
+
+/* Set up tables of imbalance values and cache of weights */
+bool init_weight_tables(state_t *s) {
+    /* No node can have more than nrat rats */
+    int limit = s->nrat + 1;
+    if (limit > IMBALANCE_LIMIT)
+	limit = IMBALANCE_LIMIT;
+    s->imbalance_limit = limit;
+    s->imbalance_table = double_alloc((size_t) limit * limit);
+    if (s->imbalance_table == NULL) {
+	outmsg("Couldn't allocate space for imbalance table");
+	return false;
+    }
+    int lcount, rcount;
+    for (lcount = 0; lcount < limit; lcount++)
+	for (rcount = 0; rcount < limit; rcount++)
+	    s->imbalance_table[lcount * limit + rcount] = imbalance(lcount, rcount);
+
+    s->weight_cache = NULL;
+    if (WEIGHT_CACHE_SIZE > 0) {
+	int nthread = 1;
+#ifdef _OPENMP
+	nthread = omp_get_max_threads();
+#endif
+	s->weight_cache = malloc((size_t) nthread * WEIGHT_CACHE_SIZE * sizeof(weight_cache_t));
+	if (s->weight_cache == NULL) {
+	    outmsg("Couldn't allocate space for weight cache");
+	    return false;
+	}
+	int i;
+	/* Count of -1 marks entry as unused */
+	for (i = 0; i < nthread * WEIGHT_CACHE_SIZE; i++)
+	    s->weight_cache[i].count = -1;
+    }
+
+    /* Space for saved imbalances only for hubs */
+    graph_t *g = s->g;
+    int nid;
+    s->hub_imbalance_start = int_alloc(g->nnode);
+    s->hub_imbalance_lcount = int_alloc(g->nnode);
+    if (s->hub_imbalance_start == NULL || s->hub_imbalance_lcount == NULL) {
+	outmsg("Couldn't allocate space for hub imbalances");
+	return false;
+    }
+    int hcount = 0;
+    for (nid = 0; nid < g->nnode; nid++) {
+	int outdegree = g->neighbor_start[nid+1] - g->neighbor_start[nid] - 1;
+	s->hub_imbalance_start[nid] = hcount;
+	if (outdegree >= HUB_THRESHOLD)
+	    hcount += outdegree;
+	s->hub_imbalance_lcount[nid] = -1;
+    }
+    s->hub_imbalance_count = hcount;
+    s->hub_imbalance = double_alloc(hcount);
+    s->hub_imbalance_rcount = int_alloc(hcount);
+    if ((s->hub_imbalance == NULL || s->hub_imbalance_rcount == NULL) && hcount > 0) {
+	outmsg("Couldn't allocate space for hub imbalances");
+	return false;
+    }
+    return true;
+}
+
+#if MPI
+/*
+  Called by process 0 to distribute initial rat positions, and seeds when restored from checkpoint.
+  Rats are ordered by zone, keeping them in Id order within each zone,
+  and each process gets only those in its zone, with their Ids.
+  Afterwards, process 0 holds its own rats at the start of the rat arrays
+ */
+void send_rats(state_t *s) {
+    graph_t *g = s->g;
+    int nzone = g->nzone;
+    int nrat = s->nrat;
+    int params[4] = {nrat, (int) s->global_seed, s->start_step, s->restored};
+    MPI_Bcast(params, 4, MPI_INT, 0, MPI_COMM_WORLD);
+    int count[nzone], start[nzone], next[nzone];
+    int r, z;
+    memset(count, 0, nzone * sizeof(int));
+    for (r = 0; r < nrat; r++)
+	count[g->zone_id[s->rat_position[r]]]++;
+    int nstart = 0;
+    for (z = 0; z < nzone; z++) {
+	start[z] = next[z] = nstart;
+	nstart += count[z];
+    }
+    MPI_Scatter(count, 1, MPI_INT, MPI_IN_PLACE, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    int *id = int_alloc(nrat > 0 ? nrat : 1);
+    int *position = int_alloc(nrat > 0 ? nrat : 1);
+    random_t *seed = s->restored ? rt_alloc(nrat > 0 ? nrat : 1) : NULL;
+    if (id == NULL || position == NULL || (s->restored && seed == NULL)) {
+	outmsg("Couldn't allocate space for distributing rats.  Exiting");
+	MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    for (r = 0; r < nrat; r++) {
+	int i = next[g->zone_id[s->rat_position[r]]]++;
+	id[i] = s->rat_id[r];
+	position[i] = s->rat_position[r];
+	if (s->restored)
+	    seed[i] = s->rat_seed[r];
+    }
+    free(s->rat_id);
+    free(s->rat_position);
+    s->rat_id = id;
+    s->rat_position = position;
+    if (s->restored) {
+	free(s->rat_seed);
+	s->rat_seed = seed;
+    }
+    MPI_Scatterv(s->rat_id, count, start, MPI_INT, MPI_IN_PLACE, count[0], MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Scatterv(s->rat_position, count, start, MPI_INT, MPI_IN_PLACE, count[0], MPI_INT,
+		 0, MPI_COMM_WORLD);
+    if (s->restored)
+	MPI_Scatterv(s->rat_seed, count, start, MPI_UNSIGNED, MPI_IN_PLACE, count[0], MPI_UNSIGNED,
+		     0, MPI_COMM_WORLD);
+    s->local_rat_count = count[0];
+}
+
+/* Called by other processes to receive the rats in their zones */
+state_t *get_rats(graph_t *g) {
+    int params[4];
+    int count;
+    MPI_Bcast(params, 4, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Scatter(NULL, 1, MPI_INT, &count, 1, MPI_INT, 0, MPI_COMM_WORLD);
+    state_t *s = new_rats(g, params[0], count, (random_t) params[1]);
+    if (s == NULL)
+	MPI_Abort(MPI_COMM_WORLD, 1);
+    s->start_step = params[2];
+    s->restored = params[3];
+    MPI_Scatterv(NULL, NULL, NULL, MPI_INT, s->rat_id, count, MPI_INT, 0, MPI_COMM_WORLD);
+    MPI_Scatterv(NULL, NULL, NULL, MPI_INT, s->rat_position, count, MPI_INT, 0, MPI_COMM_WORLD);
+    if (s->restored)
+	MPI_Scatterv(NULL, NULL, NULL, MPI_UNSIGNED, s->rat_seed, count, MPI_UNSIGNED, 0, MPI_COMM_WORLD);
+    return s;
+}
+
+/* Make space for at least n values in buffer */
+void ibuf_reserve(ibuf_t *buf, int n) {
+    if (n <= buf->capacity)
+	return;
+    int capacity = 2 * buf->capacity;
+    if (capacity < n)
+	capacity = n;
+    buf->data = realloc(buf->data, capacity * sizeof(int));
+    if (buf->data == NULL) {
+	outmsg("Couldn't allocate space for message buffer.  Exiting");
+	MPI_Abort(MPI_COMM_WORLD, 1);
+    }
+    buf->capacity = capacity;
+}
+
+/* Make space for at least n local rats */
+bool grow_rats(state_t *s, int n) {
+    if (n <= s->local_rat_capacity)
+	return true;
+    int capacity = 2 * s->local_rat_capacity;
+    if (capacity < n)
+	capacity = n;
+    s->rat_id = realloc(s->rat_id, capacity * sizeof(int));
+    s->rat_position = realloc(s->rat_position, capacity * sizeof(int));
+    s->rat_seed = realloc(s->rat_seed, capacity * sizeof(random_t));
+    s->local_rat_capacity = capacity;
+    return s->rat_id != NULL && s->rat_position != NULL && s->rat_seed != NULL;
+}
+
+/*
+  Keep only rats in this zone, seed them, and set up communication buffers.
+  Rat positions are given as nodes of the full graph
+ */
+bool setup_zone_state(state_t *s) {
+    graph_t *g = s->g;
+    int nzone = g->nzone;
+    int r;
+    int lcount = 0;
+    for (r = 0; r < s->local_rat_count; r++) {
+	int nid = subgraph_node(g, s->rat_position[r]);
+	if (nid >= 0 && g->zone_id[nid] == g->this_zone) {
+	    s->rat_id[lcount] = s->rat_id[r];
+	    s->rat_position[lcount] = nid;
+	    s->rat_seed[lcount] = s->rat_seed[r];
+	    lcount++;
+	}
+    }
+    s->local_rat_count = lcount;
+    /* Release space held for other zones' rats */
+    s->local_rat_capacity = 0;
+    if (!grow_rats(s, lcount < 1 ? 1 : lcount)) {
+	outmsg("Couldn't allocate space for %d rats", lcount);
+	return false;
+    }
+    /* Seeds restored from checkpoint are already in place */
+    if (!s->restored)
+	seed_rats(s);
+
+    s->export_rat_buffer = calloc(nzone, sizeof(ibuf_t));
+    s->import_rat_buffer.data = NULL;
+    s->import_rat_buffer.count = 0;
+    s->import_rat_buffer.capacity = 0;
+    s->export_count_buffer = calloc(nzone, sizeof(int *));
+    s->export_weight_buffer = calloc(nzone, sizeof(weight_t *));
+    s->import_count_buffer = calloc(nzone, sizeof(int *));
+    s->import_weight_buffer = calloc(nzone, sizeof(weight_t *));
+    s->request = calloc(2 * nzone, sizeof(MPI_Request));
+    bool ok = s->export_rat_buffer != NULL && s->request != NULL &&
+	s->export_count_buffer != NULL && s->export_weight_buffer != NULL &&
+	s->import_count_buffer != NULL && s->import_weight_buffer != NULL;
+    s->gather_node_list = NULL;
+    s->gather_count_buffer = NULL;
+    s->gather_zone_count = NULL;
+    s->gather_zone_start = NULL;
+    if (!ok || !reset_zone_buffers(s)) {
+	outmsg("Couldn't allocate space for zone communication");
+	return false;
+    }
+    return true;
+}
+
+/*
+  (Re)allocate buffers whose sizes depend on the zone's boundary.
+  Buffers for gathering node state are set up again when next needed
+ */
+bool reset_zone_buffers(state_t *s) {
+    graph_t *g = s->g;
+    int z;
+    bool ok = true;
+    for (z = 0; z < g->nzone; z++) {
+	free(s->export_count_buffer[z]);
+	free(s->export_weight_buffer[z]);
+	free(s->import_count_buffer[z]);
+	free(s->import_weight_buffer[z]);
+    }
+    free(s->gather_node_list);
+    free(s->gather_count_buffer);
+    free(s->gather_zone_count);
+    free(s->gather_zone_start);
+    s->gather_node_list = NULL;
+    s->gather_count_buffer = NULL;
+    s->gather_zone_count = NULL;
+    s->gather_zone_start = NULL;
+    for (z = 0; ok && z < g->nzone; z++) {
+	s->export_count_buffer[z] = int_alloc(g->export_node_count[z]);
+	s->export_weight_buffer[z] = weight_alloc(g->export_node_count[z]);
+	s->import_count_buffer[z] = int_alloc(g->import_node_count[z]);
+	s->import_weight_buffer[z] = weight_alloc(g->import_node_count[z]);
+	ok = ok && (g->export_node_count[z] == 0 ||
+		    (s->export_count_buffer[z] != NULL && s->export_weight_buffer[z] != NULL));
+	ok = ok && (g->import_node_count[z] == 0 ||
+		    (s->import_count_buffer[z] != NULL && s->import_weight_buffer[z] != NULL));
+    }
+    return ok;
+}
+
+#endif
+
+bool assign_zones_by_load(state_t *s) {
+    graph_t *g = s->g;
+    int64_t *cost = calloc(g->nfzone, sizeof(int64_t));
+    if (cost == NULL) {
+	outmsg("Couldn't allocate space for zone costs");
+	return false;
+    }
+    fzone_cost(g, NULL, g->nnode, s->rat_position, s->nrat, cost);
+    bool changed;
+    bool ok = balance_zones(g, cost, true, &changed);
+    free(cost);
+    return ok;
+}
+
+#if MPI
 /* Called by process 0 to collect node states from all other processes */
 void gather_node_state(state_t *s) {
+    graph_t *g = s->g;
+    int nnode = g->nnode;
+    int nzone = g->nzone;
+    int nid, z;
+    if (s->gather_node_list == NULL) {
+	/* Order nodes by zone.  Each zone lists its nodes in increasing order */
+	s->gather_node_list = int_alloc(nnode);
+	s->gather_count_buffer = int_alloc(nnode);
+	s->gather_zone_count = int_alloc(nzone);
+	s->gather_zone_start = int_alloc(nzone);
+	if (s->gather_node_list == NULL || s->gather_count_buffer == NULL ||
+	    s->gather_zone_count == NULL || s->gather_zone_start == NULL) {
+	    outmsg("Couldn't allocate space for gathering node state.  Exiting");
+	    MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+	for (nid = 0; nid < nnode; nid++)
+	    s->gather_zone_count[g->zone_id[nid]]++;
+	int start = 0;
+	for (z = 0; z < nzone; z++) {
+	    s->gather_zone_start[z] = start;
+	    start += s->gather_zone_count[z];
+	}
+	int *next = int_alloc(nzone);
+	memcpy(next, s->gather_zone_start, nzone * sizeof(int));
+	for (nid = 0; nid < nnode; nid++)
+	    s->gather_node_list[next[g->zone_id[nid]]++] = nid;
+	free(next);
+    }
+    int *local_counts = s->gather_count_buffer + s->gather_zone_start[g->this_zone];
+    int i;
+    for (i = 0; i < g->local_node_count; i++)
+	local_counts[i] = node_count(s, g->local_node_list[i]);
+    MPI_Gatherv(MPI_IN_PLACE, g->local_node_count, MPI_INT,
+		s->gather_count_buffer, s->gather_zone_count, s->gather_zone_start, MPI_INT,
+		0, MPI_COMM_WORLD);
+    for (i = 0; i < nnode; i++)
+	set_node_count(s, s->gather_node_list[i], s->gather_count_buffer[i]);
 }
 
 /* Called by other processes to send their node states to process 0 */
 void send_node_state(state_t *s) {
+    graph_t *g = s->g;
+    int i;
+    if (s->gather_count_buffer == NULL) {
+	s->gather_count_buffer = int_alloc(g->local_node_count);
+	if (s->gather_count_buffer == NULL) {
+	    outmsg("Couldn't allocate space for sending node state.  Exiting");
+	    MPI_Abort(MPI_COMM_WORLD, 1);
+	}
+    }
+    for (i = 0; i < g->local_node_count; i++)
+	s->gather_count_buffer[i] = node_count(s, g->local_node_list[i]);
+    MPI_Gatherv(s->gather_count_buffer, g->local_node_count, MPI_INT,
+		NULL, NULL, NULL, MPI_INT, 0, MPI_COMM_WORLD);
 }
+#endif
 
 
 
@@ -207,3 +1435,12 @@ int comp_int(const void *ap, const void *bp) {
     return -lt + gt;
 }
 
+/* Function suitable for sorting arrays of int64_t's */
+int comp_int64(const void *ap, const void *bp) {
+    int64_t a = *(int64_t *) ap;
+    int64_t b = *(int64_t *) bp;
+    int lt = a < b;
+    int gt = a > b;
+    return -lt + gt;
+}
+